@@ -0,0 +1,351 @@
+/*
+
+  mkfs.myfs: builds a MyFS backup-file from a directory tree, offline
+
+  Populating a fresh mount pushes every file through FUSE, one round trip
+  per write. Instead, this tool links the file system implementation
+  directly, builds the image in memory in a single pass over the tree, and
+  writes it out with large sequential writes. Each file is written with
+  whole-file writes, so its data is laid out contiguously. The result is a
+  clean image (its journal is empty), which myfs mounts instantly:
+
+  ./myfs --backupfile=<image> <mountpoint>
+
+  Regular files and directories are copied with their modification times.
+  Symbolic links and other special files are skipped, as MyFS has none.
+  All-zero blocks are left as holes in the backup-file.
+
+  gcc -O2 -Wall mkfs.myfs.c workingimplementation.c -lpthread -o mkfs.myfs
+
+  Usage: ./mkfs.myfs [--size=<s>] <directory> <image>
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+#define MKFS_BLOCK_SIZE    ((size_t) 4096)          /* MyFS's block size */
+#define MKFS_MIN_SIZE      ((size_t) (64 << 10))    /* 64kB */
+#define MKFS_CHUNK_SIZE    ((size_t) (8 << 20))     /* Bytes per file write */
+#define MKFS_ENTRY_BYTES   ((size_t) 512)           /* Per file/dir, for its
+                                                       inode, name and entry */
+#define MKFS_PATH_MAX      4096
+
+/* Declaration for the implementations of the operations */
+
+int __myfs_mknod_implem(void *, size_t, int *, const char *);
+int __myfs_mkdir_implem(void *, size_t, int *, const char *);
+int __myfs_write_implem(void *, size_t, int *, const char *, const char *, size_t, off_t);
+int __myfs_utimens_implem(void *, size_t, int *, const char *, const struct timespec [2]);
+int __myfs_sync_implem(void *, size_t, int *, int (*)(void *, size_t, size_t), void *, size_t *);
+
+/* End of declarations */
+
+struct __mkfs_state_struct_t {
+  const char      *src;             /* Directory tree being copied */
+  size_t          src_len;
+  void            *memory;          /* Image being built */
+  size_t          size;
+  char            *buf;             /* MKFS_CHUNK_SIZE bytes of file data */
+  size_t          files;
+  size_t          dirs;
+  size_t          skipped;
+  size_t          bytes;
+  size_t          data_blocks;      /* For sizing: blocks of file data */
+  int             failed;
+};
+
+/* nftw passes no context, so the state is global */
+static struct __mkfs_state_struct_t __mkfs_state;
+
+static int __mkfs_parse_size(size_t *size, const char *str) {
+  unsigned long long int tmp, t;
+  size_t s;
+  char *end;
+
+  if (*str == '\0') return 0;
+  tmp = strtoull(str, &end, 0);
+  if (*end != '\0') return 0;
+  s = (size_t) tmp;
+  t = (unsigned long long int) s;
+  if (tmp != t) return 0;
+  *size = s;
+  return 1;
+}
+
+/* Sets path to the image path of the host file fpath, below the source
+   directory. Returns 0 if it does not fit.
+*/
+static int __mkfs_image_path(char *path, const char *fpath) {
+  const char *rel;
+
+  rel = fpath + __mkfs_state.src_len;
+  while (*rel == '/') rel++;
+  if (snprintf(path, MKFS_PATH_MAX, "/%s", rel) >= MKFS_PATH_MAX) return 0;
+  return 1;
+}
+
+/* First pass: counts what the image must hold, to size it. */
+static int __mkfs_count(const char *fpath, const struct stat *sb, int type, struct FTW *ftw) {
+  (void) fpath;
+  (void) ftw;
+
+  if (type == FTW_D) {
+    __mkfs_state.dirs++;
+  } else if ((type == FTW_F) && S_ISREG(sb->st_mode)) {
+    __mkfs_state.files++;
+    __mkfs_state.data_blocks += ((size_t) sb->st_size + MKFS_BLOCK_SIZE - 1) / MKFS_BLOCK_SIZE;
+  }
+  return 0;
+}
+
+/* Copies the regular file at fpath into the image as path, in chunks of
+   MKFS_CHUNK_SIZE bytes, each of which is laid out after the last.
+   Returns 1 on success, else 0.
+*/
+static int __mkfs_copy_file(const char *fpath, const char *path, const struct stat *sb) {
+  struct timespec ts[2];
+  int fd, __myfs_errno;
+  ssize_t got, done, res;
+  off_t offset;
+
+  __myfs_errno = 0;
+  if (__myfs_mknod_implem(__mkfs_state.memory, __mkfs_state.size, &__myfs_errno, path) != 0) {
+    fprintf(stderr, "Cannot create %s: %s\n", path, strerror(__myfs_errno));
+    return 0;
+  }
+  if ((fd = open(fpath, O_RDONLY)) < 0) {
+    perror(fpath);
+    return 0;
+  }
+  offset = 0;
+  while ((got = read(fd, __mkfs_state.buf, MKFS_CHUNK_SIZE)) > 0) {
+    for (done=0;done<got;done+=res) {
+      res = __myfs_write_implem(__mkfs_state.memory, __mkfs_state.size, &__myfs_errno,
+                                path, __mkfs_state.buf + done, (size_t) (got - done),
+                                offset + done);
+      if (res < 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", path, strerror(__myfs_errno));
+        close(fd);
+        return 0;
+      }
+    }
+    offset += got;
+  }
+  if (got < 0) {
+    perror(fpath);
+    close(fd);
+    return 0;
+  }
+  close(fd);
+
+  ts[0] = sb->st_atim;
+  ts[1] = sb->st_mtim;
+  __myfs_utimens_implem(__mkfs_state.memory, __mkfs_state.size, &__myfs_errno, path, ts);
+  __mkfs_state.bytes += (size_t) offset;
+  return 1;
+}
+
+/* Second pass: copies each directory and regular file into the image.
+   Directories come before their contents.
+*/
+static int __mkfs_copy(const char *fpath, const struct stat *sb, int type, struct FTW *ftw) {
+  char path[MKFS_PATH_MAX];
+  int __myfs_errno;
+
+  if (ftw->level == 0) return 0;     /* The root dir exists already */
+  if (!__mkfs_image_path(path, fpath)) {
+    fprintf(stderr, "Skipping %s: path too long\n", fpath);
+    __mkfs_state.skipped++;
+    return 0;
+  }
+
+  if (type == FTW_D) {
+    __myfs_errno = 0;
+    if (__myfs_mkdir_implem(__mkfs_state.memory, __mkfs_state.size, &__myfs_errno, path) != 0) {
+      fprintf(stderr, "Cannot create %s: %s\n", path, strerror(__myfs_errno));
+      __mkfs_state.failed = 1;
+      return 1;
+    }
+    __mkfs_state.dirs++;
+  } else if ((type == FTW_F) && S_ISREG(sb->st_mode)) {
+    if (!__mkfs_copy_file(fpath, path, sb)) {
+      __mkfs_state.failed = 1;
+      return 1;
+    }
+    __mkfs_state.files++;
+  } else {
+    fprintf(stderr, "Skipping %s: not a regular file or directory\n", fpath);
+    __mkfs_state.skipped++;
+  }
+  return 0;
+}
+
+/* Flush callback for the final sync, which makes the built state a
+   checkpoint with an empty journal. Nothing is written here: checkpoints
+   made during the build already took the blocks they flushed off the
+   dirty map, so the image is written out whole afterwards instead.
+*/
+static int __mkfs_flush_none(void *ctx, size_t offset, size_t len) {
+  (void) ctx;
+  (void) offset;
+  (void) len;
+  return 0;
+}
+
+/* Writes the image to the backup-file. All-zero blocks are skipped,
+   leaving holes, and each run of the rest is written with one pwrite.
+   Returns 0 on success, else -1.
+*/
+static int __mkfs_write_image(int fd, const char *mem, size_t size) {
+  static const char zeros[MKFS_BLOCK_SIZE];
+  size_t pos, run;
+  ssize_t res;
+
+  pos = 0;
+  while (pos < size) {
+    while ((pos < size) && (memcmp(mem + pos, zeros, MKFS_BLOCK_SIZE) == 0)) pos += MKFS_BLOCK_SIZE;
+    run = pos;
+    while ((run < size) && (memcmp(mem + run, zeros, MKFS_BLOCK_SIZE) != 0)) run += MKFS_BLOCK_SIZE;
+    while (pos < run) {
+      res = pwrite(fd, mem + pos, run - pos, (off_t) pos);
+      if (res <= 0) return -1;
+      pos += (size_t) res;
+    }
+  }
+  return 0;
+}
+
+static void __mkfs_show_help(const char *name) {
+  printf("usage: %s [options] <directory> <image>\n\n", name);
+  printf("Builds a MyFS backup-file holding a copy of the directory tree.\n\n"
+         "    --size=<s>              Size of the file system\n"
+         "                            Default: enough for the tree, with room\n"
+         "                            for its directories to grow.\n"
+         "\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *size_opt, *src, *image;
+  struct timespec start, stop;
+  size_t flushed, size, blocks;
+  int __myfs_errno, i, args, fd;
+  struct stat st;
+
+  /* Parse options */
+  size_opt = NULL;
+  src = NULL;
+  image = NULL;
+  args = 0;
+  for (i=1;i<argc;i++) {
+    if (strncmp(argv[i], "--size=", 7) == 0) {
+      size_opt = argv[i] + 7;
+    } else if ((strcmp(argv[i], "-h") == 0) || (strcmp(argv[i], "--help") == 0)) {
+      __mkfs_show_help(argv[0]);
+      return 0;
+    } else if (args == 0) {
+      src = argv[i];
+      args++;
+    } else if (args == 1) {
+      image = argv[i];
+      args++;
+    } else {
+      args++;
+    }
+  }
+  if (args != 2) {
+    __mkfs_show_help(argv[0]);
+    return 1;
+  }
+  if ((stat(src, &st) != 0) || (!S_ISDIR(st.st_mode))) {
+    fprintf(stderr, "%s is not a directory\n", src);
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  memset(&__mkfs_state, 0, sizeof(__mkfs_state));
+  __mkfs_state.src = src;
+  __mkfs_state.src_len = strlen(src);
+
+  /* Handle size, by default fitting the tree with some room to spare */
+  if (size_opt != NULL) {
+    if (!__mkfs_parse_size(&size, size_opt)) {
+      fprintf(stderr, "Cannot parse size indication\n");
+      return 1;
+    }
+  } else {
+    if (nftw(src, __mkfs_count, 64, FTW_PHYS) != 0) {
+      perror("Cannot walk directory tree");
+      return 1;
+    }
+    blocks = __mkfs_state.data_blocks +
+      (__mkfs_state.files + __mkfs_state.dirs) * MKFS_ENTRY_BYTES / MKFS_BLOCK_SIZE +
+      __mkfs_state.dirs * 2;
+    blocks += blocks / 8 + 64;       /* Bitmap, journal and slack */
+    size = blocks * MKFS_BLOCK_SIZE;
+    __mkfs_state.files = 0;
+    __mkfs_state.dirs = 0;
+  }
+  if (size < MKFS_MIN_SIZE) {
+    size = MKFS_MIN_SIZE;
+  }
+  size -= size % MKFS_BLOCK_SIZE;
+
+  /* Build the image in memory */
+  __mkfs_state.size = size;
+  __mkfs_state.memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (__mkfs_state.memory == MAP_FAILED) {
+    perror("Cannot map in memory");
+    return 1;
+  }
+  if ((__mkfs_state.buf = malloc(MKFS_CHUNK_SIZE)) == NULL) {
+    perror("Cannot allocate buffer");
+    return 1;
+  }
+  if (nftw(src, __mkfs_copy, 64, FTW_PHYS) != 0) {
+    if (!__mkfs_state.failed) perror("Cannot walk directory tree");
+    fprintf(stderr, "Image not written%s\n",
+            (size_opt != NULL) ? ", try a larger --size" : "");
+    return 1;
+  }
+
+  /* Make it a clean checkpoint, then write it out */
+  if (__myfs_sync_implem(__mkfs_state.memory, size, &__myfs_errno,
+                         __mkfs_flush_none, NULL, &flushed) != 0) {
+    fprintf(stderr, "Cannot checkpoint image: %s\n", strerror(__myfs_errno));
+    return 1;
+  }
+  fd = open(image, O_CREAT | O_TRUNC | O_WRONLY, 00644);
+  if (fd < 0) {
+    perror("Cannot open image");
+    return 1;
+  }
+  if (ftruncate(fd, (off_t) size) != 0) {
+    perror("Cannot size image");
+    return 1;
+  }
+  if ((__mkfs_write_image(fd, __mkfs_state.memory, size) != 0) ||
+      (fsync(fd) != 0) ||
+      (close(fd) != 0)) {
+    perror("Cannot write image");
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+
+  printf("%s: %zu files (%zu bytes), %zu directories, %zu skipped, "
+         "%zu byte image in %.2f s\n", image, __mkfs_state.files,
+         __mkfs_state.bytes, __mkfs_state.dirs, __mkfs_state.skipped, size,
+         (double) (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9);
+  return 0;
+}
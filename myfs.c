@@ -20,6 +20,12 @@
 
   gcc -g -O0 -Wall myfs.c implementation.c `pkg-config fuse --cflags --libs` -o myfs
 
+  Built with -DMYFS_LOWLEVEL, the file system is driven through the FUSE
+  low-level API instead, where the kernel names files by inode number
+  rather than by path:
+
+  gcc -g -O0 -Wall -DMYFS_LOWLEVEL myfs.c workingimplementation.c `pkg-config fuse --cflags --libs` -o myfs
+
   The filesystem can be mounted while it is running inside gdb (for
   debugging) purposes as follows (adapt to your setup):
 
@@ -38,7 +44,11 @@
 
 #define FUSE_USE_VERSION 26
 
+#ifdef MYFS_LOWLEVEL
+#include <fuse_lowlevel.h>
+#else
 #include <fuse.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -50,11 +60,20 @@
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
 
 
 struct __myfs_options_struct_t {
         const char *filename;
         const char *size;
+        const char *max_size;
+        const char *flush_interval;
+        const char *attr_timeout;
+        const char *entry_timeout;
+        const char *max_write;
+        const char *max_read;
+        int keep_cache;
         int show_help;
 };
 
@@ -63,6 +82,13 @@ struct __myfs_options_struct_t {
 static const struct fuse_opt __myfs_option_spec[] = {
         OPTION("--backupfile=%s", filename),
         OPTION("--size=%s", size),
+        OPTION("--max-size=%s", max_size),
+        OPTION("--flush-interval=%s", flush_interval),
+        OPTION("--attr-timeout=%s", attr_timeout),
+        OPTION("--entry-timeout=%s", entry_timeout),
+        OPTION("--max-write=%s", max_write),
+        OPTION("--max-read=%s", max_read),
+        OPTION("--keep-cache", keep_cache),
         OPTION("-h", show_help),
         OPTION("--help", show_help),
         FUSE_OPT_END
@@ -75,17 +101,39 @@ struct __memory_block_struct_t {
 typedef struct __memory_block_struct_t memory_block_t;
 
 struct __myfs_environment_struct_t {
-  pthread_mutex_t env_lock;
+  pthread_mutex_t env_lock;       /* Guards the sync, flusher and grow state
+                                     only, the implementation locks 
+                                     internally */
   uid_t           uid;
   gid_t           gid;
   void            *memory;
-  size_t          size;
+  size_t          size;             /* Grows online, read with __myfs_env_size */
+  size_t          max_size;         /* Size the memory may grow to */
+  size_t          reserved;         /* Bytes of address space held at memory */
   int             using_backup;
   int             backup_fd;
+  unsigned int    flush_interval;   /* Seconds between background syncs, or 0 */
+  pthread_t       flusher;
+  pthread_cond_t  flusher_cond;
+  int             flusher_running;
+  int             flusher_stop;
+  pthread_cond_t  sync_cond;        /* Signalled when a sync completes */
+  unsigned long   syncs_started;
+  unsigned long   syncs_done;
+  int             syncing;          /* A sync is running */
+  int             sync_res;         /* Result of the last completed sync */
+  int             sync_report;      /* The next sync prints what it flushed */
+  double          attr_timeout;     /* Seconds the kernel may cache attributes */
+  double          entry_timeout;    /* Seconds the kernel may cache names */
+  size_t          max_write;        /* Largest write request, or 0 for libfuse's */
+  size_t          max_read;         /* Largest read request, or 0 for the kernel's */
+  int             keep_cache;       /* Keep cached file data across opens */
 };
 
 #define MYFS_DEFAULT_SIZE  ((size_t) (128 << 20))   /* 128MB */
 #define MYFS_MIN_SIZE      ((size_t) (2048))        /* 2kB */
+#define MYFS_GROW_RESERVE  ((size_t) 8)             /* Grow when under 1/8 free */
+#define MYFS_DEFAULT_TIMEOUT 1.0                    /* Seconds, as libfuse's */
 
 static int __myfs_parse_size(size_t *size, const char *str) {
   unsigned long long int tmp, t;
@@ -102,11 +150,36 @@ static int __myfs_parse_size(size_t *size, const char *str) {
   return 1;
 }
 
+static int __myfs_parse_timeout(double *timeout, const char *str) {
+  double tmp;
+  char *end;
+
+  if (*str == '\0') return 0;
+  tmp = strtod(str, &end);
+  if (*end != '\0') return 0;
+  if (!(tmp >= 0.0)) return 0;
+  *timeout = tmp;
+  return 1;
+}
+
+static int __myfs_parse_interval(unsigned int *interval, const char *str) {
+  unsigned long int tmp;
+  char *end;
+
+  if (*str == '\0') return 0;
+  tmp = strtoul(str, &end, 10);
+  if (*end != '\0') return 0;
+  if (tmp != (unsigned long int) ((unsigned int) tmp)) return 0;
+  *interval = (unsigned int) tmp;
+  return 1;
+}
+
 static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, struct __myfs_options_struct_t *opts) {
   int size_specified, using_backup;
-  size_t size;
+  size_t size, max_size, reserved;
   int fd;
-  void *memory;
+  void *memory, *base;
+  int fixed;
   off_t off;
   size_t len;
   size_t orig_size;
@@ -131,6 +204,56 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     size = MYFS_MIN_SIZE;
   }
 
+  /* Handle maximum size */
+  max_size = 0;
+  if (opts->max_size != NULL) {
+    if (!__myfs_parse_size(&max_size, opts->max_size)) {
+      fprintf(stderr, "Cannot parse maximum size indication\n");
+      return 0;
+    }
+  }
+
+  /* Handle flush interval */
+  env->flush_interval = 0;
+  env->flusher_running = 0;
+  if (opts->flush_interval != NULL) {
+    if (!__myfs_parse_interval(&(env->flush_interval), opts->flush_interval)) {
+      fprintf(stderr, "Cannot parse flush interval indication\n");
+      return 0;
+    }
+    if ((opts->filename == NULL) && (env->flush_interval != 0)) {
+      fprintf(stderr, "Ignoring flush interval, no backup-file is given\n");
+      env->flush_interval = 0;
+    }
+  }
+
+  /* Handle kernel cache and request size tuning */
+  env->attr_timeout = MYFS_DEFAULT_TIMEOUT;
+  env->entry_timeout = MYFS_DEFAULT_TIMEOUT;
+  env->max_write = 0;
+  env->max_read = 0;
+  env->keep_cache = opts->keep_cache;
+  if ((opts->attr_timeout != NULL) && 
+      (!__myfs_parse_timeout(&(env->attr_timeout), opts->attr_timeout))) {
+    fprintf(stderr, "Cannot parse attribute timeout indication\n");
+    return 0;
+  }
+  if ((opts->entry_timeout != NULL) && 
+      (!__myfs_parse_timeout(&(env->entry_timeout), opts->entry_timeout))) {
+    fprintf(stderr, "Cannot parse entry timeout indication\n");
+    return 0;
+  }
+  if ((opts->max_write != NULL) && 
+      (!__myfs_parse_size(&(env->max_write), opts->max_write))) {
+    fprintf(stderr, "Cannot parse maximum write size indication\n");
+    return 0;
+  }
+  if ((opts->max_read != NULL) && 
+      (!__myfs_parse_size(&(env->max_read), opts->max_read))) {
+    fprintf(stderr, "Cannot parse maximum read size indication\n");
+    return 0;
+  }
+
   /* Setup lock for the threads */
   if (pthread_mutex_init(&(env->env_lock), NULL) != 0) {
     perror("Cannot setup mutex");
@@ -191,11 +314,42 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     orig_size = 0;
   }
 
+  /* If the filesystem may grow, reserve the address space it may grow
+     into, so the memory is extended in place and never moves under
+     operations running during a grow.
+  */
+  if (max_size < size) {
+    max_size = size;
+  }
+  reserved = size;
+  base = NULL;
+  fixed = 0;
+  if (max_size > size) {
+    base = mmap(NULL, max_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+      perror("Cannot reserve memory to grow into");
+      if (using_backup) {
+        if (close(fd) != 0) {
+          perror("Cannot close backup-file");
+        }
+      }
+      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
+        perror("Cannot destroy mutex");
+      }
+      return 0;
+    }
+    reserved = max_size;
+    fixed = MAP_FIXED;
+  }
+
   /* Do the mmap */
   if (using_backup) {
-    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    memory = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | fixed, fd, 0);
     if (memory == MAP_FAILED) {
       perror("Cannot map backup-file into memory");
+      if ((base != NULL) && (munmap(base, reserved) != 0)) {
+        perror("Cannot unmap memory");
+      }
       if (close(fd) != 0) {
         perror("Cannot close backup-file");
       }
@@ -205,9 +359,12 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
       return 0;
     }
   } else {
-    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    memory = mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | fixed, -1, 0);
     if (memory == MAP_FAILED) {
       perror("Cannot map in memory");
+      if ((base != NULL) && (munmap(base, reserved) != 0)) {
+        perror("Cannot unmap memory");
+      }
       if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
         perror("Cannot destroy mutex");
       }
@@ -227,23 +384,271 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     }
   }
   
+  /* Setup the sync state */
+  if (pthread_cond_init(&(env->sync_cond), NULL) != 0) {
+    perror("Cannot setup condition variable");
+    if (munmap(memory, reserved) != 0) {
+      perror("Cannot unmap memory");
+    }
+    if (using_backup) {
+      if (close(fd) != 0) {
+        perror("Cannot close backup-file");
+      }
+    }
+    if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
+      perror("Cannot destroy mutex");
+    }
+    return 0;
+  }
+  env->syncs_started = 0;
+  env->syncs_done = 0;
+  env->syncing = 0;
+  env->sync_res = 0;
+  env->sync_report = 0;
+  
   /* Get uid and gid, write back and succeed */
   env->uid = getuid();
   env->gid = getgid();
   env->memory = memory;
   env->size = size;
+  env->max_size = max_size;
+  env->reserved = reserved;
   env->using_backup = using_backup;
   env->backup_fd = fd;
   return 1;
 }
 
+int __myfs_sync_implem(void *, size_t, int *, int (*)(void *, size_t, size_t), void *, size_t *);
+int __myfs_grow_implem(void *, size_t, int *);
+int __myfs_statfs_implem(void *, size_t, int *, struct statvfs*);
+
+/* Returns the current size of the memory map, which a grow may change
+   while operations run.
+*/
+static size_t __myfs_env_size(struct __myfs_environment_struct_t *env) {
+  return __atomic_load_n(&(env->size), __ATOMIC_ACQUIRE);
+}
+
+/* Writes back len bytes of the memory map, starting offset bytes in,
+   to the backup-file. The range is widened to whole pages for msync.
+*/
+static int __myfs_flush_range(void *ctx, size_t offset, size_t len) {
+  struct __myfs_environment_struct_t *env;
+  size_t page_size, start;
+
+  env = (struct __myfs_environment_struct_t *) ctx;
+  page_size = (size_t) sysconf(_SC_PAGESIZE);
+  start = offset - (offset % page_size);
+  if (offset + len > __myfs_env_size(env)) len = __myfs_env_size(env) - offset;
+  return msync(((char *) env->memory) + start, offset + len - start, MS_SYNC);
+}
+
+/* Writes everything changed since the last sync back to the backup-file.
+   If report is set, prints how much that was.
+*/
+static int __myfs_sync_environment(struct __myfs_environment_struct_t *env, int report) {
+  size_t flushed;
+  int __myfs_errno;
+  
+  if (env == NULL) return -1;
+  if (!(env->using_backup)) return 0;
+  if (__myfs_sync_implem(env->memory, __myfs_env_size(env), &__myfs_errno,
+                         __myfs_flush_range, env, &flushed) != 0) return -1;
+  if (flushed == ((size_t) 0)) return 0;
+  if (fsync(env->backup_fd) != 0) return -1;
+  if (report) {
+    fprintf(stderr, "myfs: sync: flushed %zu of %zu bytes\n", flushed, __myfs_env_size(env));
+  }
+  return 0;
+}
+
+/* Syncs the backup-file with everything written before the call. Callers
+   that arrive while a sync is running wait for the next one, which a single
+   caller runs on behalf of all of them (a group commit), without holding
+   env_lock. The sync prints what it flushed if any of its callers asked to
+   report it (fsync does, the background flusher does not). Must be called
+   with env_lock held.
+*/
+static int __myfs_sync_group(struct __myfs_environment_struct_t *env, int report) {
+  unsigned long target, mine;
+  int res, reporting;
+
+  target = env->syncs_started + 1;
+  if (report) env->sync_report = 1;
+  while (env->syncs_done < target) {
+    if (env->syncing) {
+      pthread_cond_wait(&(env->sync_cond), &(env->env_lock));
+      continue;
+    }
+    env->syncing = 1;
+    mine = ++(env->syncs_started);
+    reporting = env->sync_report;
+    env->sync_report = 0;
+    pthread_mutex_unlock(&(env->env_lock));
+    res = __myfs_sync_environment(env, reporting);
+    pthread_mutex_lock(&(env->env_lock));
+    env->syncing = 0;
+    env->syncs_done = mine;
+    env->sync_res = res;
+    pthread_cond_broadcast(&(env->sync_cond));
+  }
+  return env->sync_res;
+}
+
+/* Grows the memory map (and backup-file) to new_size bytes, mapping the
+   new part into the address space reserved after it, then grows the
+   filesystem over it. Syncs are held off meanwhile, as they must not run
+   during a grow. If the filesystem cannot grow, no further grows are 
+   tried. Must be called with env_lock held.
+*/
+static int __myfs_grow_environment(struct __myfs_environment_struct_t *env, size_t new_size) {
+  size_t size, page_size, from;
+  void *res;
+  int __myfs_errno, ok;
+
+  while (env->syncing) {
+    pthread_cond_wait(&(env->sync_cond), &(env->env_lock));
+  }
+  env->syncing = 1;
+
+  size = env->size;
+  page_size = (size_t) sysconf(_SC_PAGESIZE);
+  from = ((size + page_size - 1) / page_size) * page_size;
+  ok = 1;
+  if (env->using_backup) {
+    if (ftruncate(env->backup_fd, new_size) != 0) {
+      perror("Cannot grow backup-file");
+      ok = 0;
+    }
+  }
+  if (ok && (new_size > from)) {
+    if (env->using_backup) {
+      res = mmap(((char *) env->memory) + from, new_size - from, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, env->backup_fd, (off_t) from);
+    } else {
+      res = mmap(((char *) env->memory) + from, new_size - from, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    }
+    if (res == MAP_FAILED) {
+      perror("Cannot grow memory map");
+      ok = 0;
+    }
+  }
+  if (ok) {
+    if (__myfs_grow_implem(env->memory, new_size, &__myfs_errno) != 0) {
+      fprintf(stderr, "myfs: cannot grow file system: %s\n", strerror(__myfs_errno));
+      ok = 0;
+    }
+  }
+  if (ok) {
+    __atomic_store_n(&(env->size), new_size, __ATOMIC_RELEASE);
+    fprintf(stderr, "myfs: grew to %zu bytes\n", new_size);
+  } else {
+    __atomic_store_n(&(env->max_size), size, __ATOMIC_RELAXED);
+  }
+
+  env->syncing = 0;
+  pthread_cond_broadcast(&(env->sync_cond));
+  return ok;
+}
+
+/* Grows the filesystem ahead of an operation needing about need bytes, if
+   it may still grow and would be left with less than 1/MYFS_GROW_RESERVE
+   of its size free. It at least doubles, up to max_size.
+*/
+static void __myfs_maybe_grow(struct __myfs_environment_struct_t *env, size_t need) {
+  struct statvfs st;
+  size_t size, max_size, new_size;
+  int __myfs_errno;
+
+  size = __myfs_env_size(env);
+  max_size = __atomic_load_n(&(env->max_size), __ATOMIC_RELAXED);
+  if (size >= max_size) return;
+  if (__myfs_statfs_implem(env->memory, size, &__myfs_errno, &st) != 0) return;
+  if (st.f_bfree * st.f_frsize >= need + size / MYFS_GROW_RESERVE) return;
+
+  pthread_mutex_lock(&(env->env_lock));
+  if (env->size == size) {      /* Else another operation grew it */
+    new_size = size * 2;
+    if (new_size < size + 2 * need) new_size = size + 2 * need;
+    if (new_size > max_size) new_size = max_size;
+    __myfs_grow_environment(env, new_size);
+  }
+  pthread_mutex_unlock(&(env->env_lock));
+}
+
+/* Background flusher: syncs the backup-file every flush_interval seconds
+   until told to stop. Holds env_lock only while waiting, which FUSE
+   operations other than fsync never take.
+*/
+static void *__myfs_flusher(void *arg) {
+  struct __myfs_environment_struct_t *env;
+  struct timespec deadline;
+  
+  env = (struct __myfs_environment_struct_t *) arg;
+  pthread_mutex_lock(&(env->env_lock));
+  while (!(env->flusher_stop)) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += env->flush_interval;
+    while ((!(env->flusher_stop)) &&
+           (pthread_cond_timedwait(&(env->flusher_cond), &(env->env_lock), &deadline) != ETIMEDOUT));
+    if (env->flusher_stop) break;
+    if (__myfs_sync_group(env, 0) != 0) {
+      perror("Cannot synchronize memory map with backup-file");
+    }
+  }
+  pthread_mutex_unlock(&(env->env_lock));
+  return NULL;
+}
+
+/* Starts the background flusher, if a flush interval is set. Must be
+   called after FUSE has daemonized, as threads do not survive the fork.
+*/
+static void __myfs_start_flusher(struct __myfs_environment_struct_t *env) {
+  pthread_condattr_t attr;
+
+  if (env->flush_interval == 0) return;
+  if (pthread_condattr_init(&attr) != 0) {
+    perror("Cannot setup flusher");
+    return;
+  }
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  if (pthread_cond_init(&(env->flusher_cond), &attr) != 0) {
+    perror("Cannot setup flusher");
+    pthread_condattr_destroy(&attr);
+    return;
+  }
+  pthread_condattr_destroy(&attr);
+  env->flusher_stop = 0;
+  if (pthread_create(&(env->flusher), NULL, __myfs_flusher, env) != 0) {
+    perror("Cannot start flusher");
+    pthread_cond_destroy(&(env->flusher_cond));
+    return;
+  }
+  env->flusher_running = 1;
+}
+
+/* Stops the background flusher, if running, and waits for it to exit. */
+static void __myfs_stop_flusher(struct __myfs_environment_struct_t *env) {
+  if (!(env->flusher_running)) return;
+  pthread_mutex_lock(&(env->env_lock));
+  env->flusher_stop = 1;
+  pthread_cond_signal(&(env->flusher_cond));
+  pthread_mutex_unlock(&(env->env_lock));
+  if (pthread_join(env->flusher, NULL) != 0) {
+    perror("Cannot join flusher");
+  }
+  pthread_cond_destroy(&(env->flusher_cond));
+  env->flusher_running = 0;
+}
+
 static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
   if (env->using_backup) {
-    if (msync(env->memory, env->size, MS_SYNC) != 0) {
+    if (__myfs_sync_environment(env, 1) != 0) {
       perror("Cannot synchronize memory map with backup-file");
     }
   }
-  if (munmap(env->memory, env->size) != 0) {
+  if (munmap(env->memory, env->reserved) != 0) {
     perror("Cannot unmap memory");
   }
   if (env->using_backup) {
@@ -251,39 +656,153 @@ static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
       perror("Cannot close backup-file");
     }
   }
+  if (pthread_cond_destroy(&(env->sync_cond)) != 0) {
+    perror("Cannot destroy condition variable");
+  }
   if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
     perror("Cannot destroy mutex");
   }
 }
 
-static int __myfs_sync_environment(struct __myfs_environment_struct_t *env) {
-  if (env == NULL) return -1;
-  if (!(env->using_backup)) return 0;
-  if (msync(env->memory, env->size, MS_SYNC) != 0) return -1;
-  if (fsync(env->backup_fd) != 0) return -1;
-  return 0;
-}
-
 /* Declaration for the implementations of the operations */
 
 int __myfs_getattr_implem(void *, size_t, int *, uid_t, gid_t, const char *, struct stat *);
-int __myfs_readdir_implem(void *, size_t, int *, const char *, char ***);
 int __myfs_mknod_implem(void *, size_t, int *, const char *);
 int __myfs_unlink_implem(void *, size_t, int *, const char *);
 int __myfs_mkdir_implem(void *, size_t, int *, const char *);
 int __myfs_rmdir_implem(void *, size_t, int *, const char *);
 int __myfs_rename_implem(void *, size_t, int *, const char *, const char*);
 int __myfs_truncate_implem(void *, size_t, int *, const char *, off_t);
-int __myfs_open_implem(void *, size_t, int *, const char *);
-int __myfs_read_implem(void *, size_t, int *, const char *, char *, size_t, off_t);
-int __myfs_write_implem(void *, size_t, int *, const char *, const char *, size_t, off_t);
-int __myfs_statfs_implem(void *, size_t, int *, struct statvfs*);
+int __myfs_openfh_implem(void *, size_t, int *, const char *, uint64_t *);
+int __myfs_release_implem(void *, size_t, int *, uint64_t);
+int __myfs_readfh_implem(void *, size_t, int *, uint64_t, char *, size_t, off_t);
+int __myfs_writefh_implem(void *, size_t, int *, uint64_t, const char *, size_t, off_t);
+int __myfs_readbuf_implem(void *, size_t, int *, uint64_t, size_t, off_t,
+                          int (*)(void *, const struct iovec *, int), void *);
+int __myfs_writebuf_implem(void *, size_t, int *, uint64_t, size_t, off_t,
+                           size_t (*)(void *, const struct iovec *, int), void *);
 int __myfs_utimens_implem(void *, size_t, int *, const char *, const struct timespec [2]);
+void __myfs_lookupstats_implem(size_t *, size_t *);
+int __myfs_lookup_implem(void *, size_t, int *, uid_t, gid_t, uint64_t, const char *, struct stat *);
+int __myfs_forget_implem(void *, size_t, int *, uint64_t, uint64_t);
+int __myfs_hold_implem(void *, size_t, int *, uint64_t);
+int __myfs_getattrfh_implem(void *, size_t, int *, uid_t, gid_t, uint64_t, struct stat *);
+int __myfs_readdirfh_implem(void *, size_t, int *, uid_t, gid_t, uint64_t, off_t,
+                            int (*)(void *, const char *, const struct stat *, off_t), void *);
+int __myfs_mknodat_implem(void *, size_t, int *, uid_t, gid_t, uint64_t, const char *, struct stat *);
+int __myfs_mkdirat_implem(void *, size_t, int *, uid_t, gid_t, uint64_t, const char *, struct stat *);
+int __myfs_unlinkat_implem(void *, size_t, int *, uint64_t, const char *);
+int __myfs_rmdirat_implem(void *, size_t, int *, uint64_t, const char *);
+int __myfs_renameat_implem(void *, size_t, int *, uint64_t, const char *, uint64_t, const char *);
+int __myfs_truncatefh_implem(void *, size_t, int *, uint64_t, off_t);
+int __myfs_utimensfh_implem(void *, size_t, int *, uint64_t, const struct timespec [2]);
 
 /* End of declarations */
 
 /* FUSE operations part */
 
+static void __myfs_destroy(void *private_data) {
+  struct __myfs_environment_struct_t *env;
+  size_t hits, misses;
+  
+  if (private_data == NULL) return;
+  env = (struct __myfs_environment_struct_t *) private_data;
+  __myfs_stop_flusher(env);
+  __myfs_lookupstats_implem(&hits, &misses);
+  fprintf(stderr, "myfs: path lookup cache: %zu hits, %zu misses\n", hits, misses);
+  __myfs_clear_environment(env);
+}
+
+/* Lets the kernel send writes of more than a page, up to max_write, and
+   limits its readahead to max_read, if these are set. Kernel caching of
+   names and attributes is set up by mount options (see 
+   __myfs_add_tuning_args), or on each reply by the low-level driver.
+*/
+static void __myfs_tune_conn(struct __myfs_environment_struct_t *env, struct fuse_conn_info *conn) {
+  conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+  if ((env->max_write != ((size_t) 0)) && (env->max_write < conn->max_write)) {
+    conn->max_write = (unsigned) env->max_write;
+  }
+  if ((env->max_read != ((size_t) 0)) && (env->max_read < conn->max_readahead)) {
+    conn->max_readahead = (unsigned) env->max_read;
+  }
+}
+
+/* Buffer vectors let libfuse copy file data straight from and to the memory
+   map, or splice it, rather than through a buffer of its own (FUSE 2.9+).
+   The ranges of the map stay the file's only while its lock is held, so 
+   reads go through them only in the low-level driver, which replies before
+   the lock is dropped. The high-level driver has no read_buf: it would 
+   return the ranges for libfuse to copy after the lock is dropped, when a
+   truncate or unlink may have given the blocks to another file. */
+#if FUSE_VERSION >= 29
+
+/* Asks the kernel to pass file data through pipes, so that it can be 
+   spliced, moving pages rather than copying them where it can.
+*/
+static void __myfs_want_splice(struct fuse_conn_info *conn) {
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+                                 FUSE_CAP_SPLICE_WRITE |
+                                 FUSE_CAP_SPLICE_MOVE);
+}
+
+/* Returns a buffer vector of the nsegs ranges segs of the memory map, to
+   be freed with free, or NULL if out of memory. If env is given and has a
+   backup-file, the ranges of the map are given as the same ranges of the
+   file, which shares its pages, so that the kernel can splice them.
+*/
+static struct fuse_bufvec *__myfs_bufvec_new(struct __myfs_environment_struct_t *env,
+                                             const struct iovec *segs, int nsegs) {
+  struct fuse_bufvec *bufv;
+  char *base, *memory;
+  int i;
+
+  bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec) +
+                                       ((nsegs > 1) ? (nsegs - 1) : 0) * sizeof(struct fuse_buf));
+  if (bufv == NULL) return NULL;
+  *bufv = FUSE_BUFVEC_INIT(0);
+  if (nsegs > 0) bufv->count = (size_t) nsegs;
+  for (i=0;i<nsegs;i++) {
+    base = (char *) segs[i].iov_base;
+    bufv->buf[i].size = segs[i].iov_len;
+    bufv->buf[i].flags = (enum fuse_buf_flags) 0;
+    bufv->buf[i].mem = base;
+    bufv->buf[i].fd = -1;
+    bufv->buf[i].pos = 0;
+    if ((env != NULL) && env->using_backup) {
+      memory = (char *) env->memory;
+      if ((base >= memory) && (base < memory + __myfs_env_size(env))) {
+        bufv->buf[i].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        bufv->buf[i].mem = NULL;
+        bufv->buf[i].fd = env->backup_fd;
+        bufv->buf[i].pos = (off_t) (base - memory);
+      }
+    }
+  }
+  return bufv;
+}
+
+/* Copies the bytes of the buffer vector ctx (which may be a pipe of 
+   spliced pages) into the nsegs ranges segs of the memory map, for 
+   __myfs_writebuf_implem. Returns the number of bytes copied.
+*/
+static size_t __myfs_bufvec_fill(void *ctx, const struct iovec *segs, int nsegs) {
+  struct fuse_bufvec *src, *dst;
+  ssize_t res;
+
+  src = (struct fuse_bufvec *) ctx;
+  dst = __myfs_bufvec_new(NULL, segs, nsegs);
+  if (dst == NULL) return 0;
+  res = fuse_buf_copy(dst, src, (enum fuse_buf_copy_flags) 0);
+  free(dst);
+  if (res < 0) return 0;
+  return (size_t) res;
+}
+
+#endif
+
+#ifndef MYFS_LOWLEVEL
+
 static int __myfs_getattr(const char *path, struct stat *st) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
@@ -295,62 +814,87 @@ static int __myfs_getattr(const char *path, struct stat *st) {
   memset(st, 0, sizeof(struct stat));
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_getattr_implem(env->memory,
-                              env->size,
+                              __myfs_env_size(env),
                               &__myfs_errno,
                               env->uid,
                               env->gid,
                               path,
                               st);
-  pthread_mutex_unlock(&(env->env_lock));  
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
+static int __myfs_opendir(const char* path, struct fuse_file_info* fi) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  
+  /* Resolve the path once; each readdir call then goes by the handle */
+  __myfs_errno = ENOENT;
+  res = __myfs_openfh_implem(env->memory,
+                             __myfs_env_size(env),
+                             &__myfs_errno,
+                             path,
+                             &(fi->fh));
+  if (res >= 0)
+    return res;
+  return -__myfs_errno;
+}
+
+struct __myfs_readdir_ctx {
+  void            *buf;
+  fuse_fill_dir_t filler;
+};
+
+static int __myfs_readdir_fill(void *ctx, const char *name, const struct stat *st, off_t next) {
+  struct __myfs_readdir_ctx *c;
+
+  c = (struct __myfs_readdir_ctx *) ctx;
+  return c->filler(c->buf, name, st, next + 2);
+}
+
+/* Streams the entries, with their attributes, into filler until its buffer
+   is full, and is called again from the offset of the last one passed.
+   Offsets 1 and 2 follow . and .., the others are the implementation's
+   positions plus 2.
+*/
 static int __myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                           off_t offset, struct fuse_file_info *fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
-  int __myfs_errno, res, i;
-  char **names;
+  struct __myfs_readdir_ctx c;
+  struct stat st;
+  int __myfs_errno, res;
   
-  (void) offset;
-  (void) fi;
+  (void) path;
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
 
-  names = NULL;
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_readdir_implem(env->memory,
-                              env->size,
-                              &__myfs_errno,
-                              path,
-                              &names);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0) {
-    if (res == 0) {
-      filler(buf, ".", NULL, 0);
-      filler(buf, "..", NULL, 0);
-      return 0;
-    } else {
-      if (names != NULL) {
-        filler(buf, ".", NULL, 0);
-        filler(buf, "..", NULL, 0);
-        for (i=0;i<res;i++) {
-          filler(buf, names[i], NULL, 0);
-          free(names[i]);
-        }
-        free(names);
-        return 0;
-      } else {
-        return -ENOENT;
-      }
-    }
-  }
+  memset(&st, 0, sizeof(struct stat));
+  st.st_mode = S_IFDIR;
+  if ((offset < 1) && filler(buf, ".", &st, 1)) return 0;
+  if ((offset < 2) && filler(buf, "..", &st, 2)) return 0;
+
+  c.buf = buf;
+  c.filler = filler;
+  __myfs_errno = EBADF;
+  res = __myfs_readdirfh_implem(env->memory,
+                                __myfs_env_size(env),
+                                &__myfs_errno,
+                                env->uid,
+                                env->gid,
+                                fi->fh,
+                                (offset < 2) ? 0 : (offset - 2),
+                                __myfs_readdir_fill,
+                                &c);
+  if (res >= 0)
+    return 0;
   return -__myfs_errno;
 }
 
@@ -366,13 +910,12 @@ static int __myfs_mknod(const char* path, mode_t mode, dev_t dev) {
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
+  __myfs_maybe_grow(env, 0);
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_mknod_implem(env->memory,
-                            env->size,
+                            __myfs_env_size(env),
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -387,12 +930,10 @@ static int __myfs_unlink(const char* path) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_unlink_implem(env->memory,
-                             env->size,
+                             __myfs_env_size(env),
                              &__myfs_errno,
                              path);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -406,13 +947,12 @@ static int __myfs_mkdir(const char* path, mode_t mode) {
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
+  __myfs_maybe_grow(env, 0);
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_mkdir_implem(env->memory,
-                            env->size,
+                            __myfs_env_size(env),
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -427,12 +967,10 @@ static int __myfs_rmdir(const char* path) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_rmdir_implem(env->memory,
-                            env->size,
+                            __myfs_env_size(env),
                             &__myfs_errno,
                             path);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -447,13 +985,11 @@ static int __myfs_rename(const char* from, const char* to) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_rename_implem(env->memory,
-                             env->size,
+                             __myfs_env_size(env),
                              &__myfs_errno,
                              from,
                              to);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -468,13 +1004,11 @@ static int __myfs_truncate(const char* path, off_t size) {
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
   res = __myfs_truncate_implem(env->memory,
-                               env->size,
+                               __myfs_env_size(env),
                                &__myfs_errno,
                                path,
                                size);
-  pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -493,69 +1027,70 @@ static int __myfs_open(const char* path, struct fuse_file_info* fi) {
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
+  /* Cached data stays valid across opens, as all writes come through
+     the kernel */
+  fi->keep_cache = env->keep_cache;
+
+  /* Resolve the path once; reads and writes then go by the handle */
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_open_implem(env->memory,
-                           env->size,
-                           &__myfs_errno,
-                           path);
-  pthread_mutex_unlock(&(env->env_lock));
+  res = __myfs_openfh_implem(env->memory,
+                             __myfs_env_size(env),
+                             &__myfs_errno,
+                             path,
+                             &(fi->fh));
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
-static int __myfs_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+static int __myfs_release(const char* path, struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
 
-  (void) fi;
+  (void) path;
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_read_implem(env->memory,
-                           env->size,
-                           &__myfs_errno,
-                           path,
-                           buf,
-                           size,
-                           offset);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_errno = EBADF;
+  res = __myfs_release_implem(env->memory,
+                              __myfs_env_size(env),
+                              &__myfs_errno,
+                              fi->fh);
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
-static int __myfs_write(const char* path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+static int __myfs_releasedir(const char* path, struct fuse_file_info* fi) {
+  return __myfs_release(path, fi);
+}
+
+static int __myfs_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
 
-  (void) fi;
+  (void) path;
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_write_implem(env->memory,
-                            env->size,
-                            &__myfs_errno,
-                            path,
-                            buf,
-                            size,
-                            offset);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_errno = EBADF;
+  res = __myfs_readfh_implem(env->memory,
+                             __myfs_env_size(env),
+                             &__myfs_errno,
+                             fi->fh,
+                             buf,
+                             size,
+                             offset);
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
-static int __myfs_statfs(const char* path, struct statvfs* stbuf) {
+static int __myfs_write(const char* path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
@@ -564,37 +1099,90 @@ static int __myfs_statfs(const char* path, struct statvfs* stbuf) {
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
-
-  memset(stbuf, 0, sizeof(struct statvfs));
   
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_statfs_implem(env->memory,
-                             env->size,
-                             &__myfs_errno,
-                             stbuf);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_maybe_grow(env, size);
+  __myfs_errno = EBADF;
+  res = __myfs_writefh_implem(env->memory,
+                              __myfs_env_size(env),
+                              &__myfs_errno,
+                              fi->fh,
+                              buf,
+                              size,
+                              offset);
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
-static int __myfs_utimens(const char* path, const struct timespec ts[2]) {
+#if FUSE_VERSION >= 29
+/* Copies the written bytes from libfuse's buffer (or pipe) straight into
+   the file's blocks in the memory map.
+*/
+static int __myfs_write_buf(const char* path, struct fuse_bufvec *buf, off_t offset,
+                            struct fuse_file_info* fi) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  size_t size;
 
+  (void) path;
+  
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_utimens_implem(env->memory,
-                              env->size,
-                              &__myfs_errno,
-                              path,
-                              ts);
-  pthread_mutex_unlock(&(env->env_lock));
+  size = fuse_buf_size(buf);
+  __myfs_maybe_grow(env, size);
+  __myfs_errno = EBADF;
+  res = __myfs_writebuf_implem(env->memory,
+                               __myfs_env_size(env),
+                               &__myfs_errno,
+                               fi->fh,
+                               size,
+                               offset,
+                               __myfs_bufvec_fill,
+                               buf);
+  if (res >= 0)
+    return res;
+  return -__myfs_errno;
+}
+#endif
+
+static int __myfs_statfs(const char* path, struct statvfs* stbuf) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  (void) path;
+  
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  memset(stbuf, 0, sizeof(struct statvfs));
+  
+  __myfs_errno = ENOENT;
+  res = __myfs_statfs_implem(env->memory,
+                             __myfs_env_size(env),
+                             &__myfs_errno,
+                             stbuf);
+  if (res >= 0)
+    return res;
+  return -__myfs_errno;
+}
+
+static int __myfs_utimens(const char* path, const struct timespec ts[2]) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  
+  __myfs_errno = ENOENT;
+  res = __myfs_utimens_implem(env->memory,
+                              __myfs_env_size(env),
+                              &__myfs_errno,
+                              path,
+                              ts);
   if (res >= 0)
     return res;
   return -__myfs_errno;
@@ -614,24 +1202,35 @@ static int __myfs_fsync(const char *path, int datasync, struct fuse_file_info *f
   
   __myfs_errno = EIO;
   pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_sync_environment(env);
+  res = __myfs_sync_group(env, 1);
   pthread_mutex_unlock(&(env->env_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;  
 }
 
-static void __myfs_destroy(void *private_data) {
+static void *__myfs_init(struct fuse_conn_info *conn) {
+  struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
-  
-  if (private_data == NULL) return;
-  env = (struct __myfs_environment_struct_t *) private_data;
-  __myfs_clear_environment(env);
+
+#if FUSE_VERSION >= 29
+  __myfs_want_splice(conn);
+#endif
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  if (env != NULL) {
+    __myfs_tune_conn(env, conn);
+    __myfs_start_flusher(env);
+  }
+  return env;
 }
 
 static struct fuse_operations __myfs_operations = {
   .getattr = __myfs_getattr,
+  .opendir = __myfs_opendir,
   .readdir = __myfs_readdir,
+  .releasedir = __myfs_releasedir,
   .mkdir = __myfs_mkdir,
   .mknod = __myfs_mknod,
   .unlink = __myfs_unlink,
@@ -641,12 +1240,671 @@ static struct fuse_operations __myfs_operations = {
   .open = __myfs_open,
   .read = __myfs_read,
   .write = __myfs_write,
+  .release = __myfs_release,
+#if FUSE_VERSION >= 29
+  .write_buf = __myfs_write_buf,
+#endif
   .statfs = __myfs_statfs,
   .utimens = __myfs_utimens,
   .fsync = __myfs_fsync,
+  .init = __myfs_init,
+  .destroy = __myfs_destroy
+};
+
+#else /* MYFS_LOWLEVEL */
+
+/* The kernel names inodes by numbers one past MyFS's, as it reserves 0 
+   and gives the root FUSE_ROOT_ID, while MyFS's root is inode 0. Handles
+   from open are MyFS inode numbers, as with the path-based operations.
+*/
+#define MYFS_INO(num)   ((fuse_ino_t) ((num) + 1))
+#define MYFS_NUM(ino)   ((uint64_t) ((ino) - 1))
+
+/* Replies to a lookup, mknod or mkdir with the entry e, whose attributes
+   the implementation filled in. The lookup it counted is dropped again
+   if the request was interrupted, as the kernel will not forget it.
+*/
+static void __myfs_ll_reply_entry(fuse_req_t req, struct fuse_entry_param *e) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  e->ino = MYFS_INO(e->attr.st_ino);
+  e->attr.st_ino = e->ino;
+  e->attr_timeout = env->attr_timeout;
+  e->entry_timeout = env->entry_timeout;
+  if (fuse_reply_entry(req, e) != 0) {
+    __myfs_forget_implem(env->memory,
+                         __myfs_env_size(env),
+                         &__myfs_errno,
+                         MYFS_NUM(e->ino),
+                         1);
+  }
+}
+
+static void __myfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  struct __myfs_environment_struct_t *env;
+  struct fuse_entry_param e;
+  int __myfs_errno, res;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  memset(&e, 0, sizeof(struct fuse_entry_param));
+
+  __myfs_errno = ENOENT;
+  res = __myfs_lookup_implem(env->memory,
+                             __myfs_env_size(env),
+                             &__myfs_errno,
+                             env->uid,
+                             env->gid,
+                             MYFS_NUM(parent),
+                             name,
+                             &(e.attr));
+  if (res < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  __myfs_ll_reply_entry(req, &e);
+}
+
+static void __myfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  __myfs_forget_implem(env->memory,
+                       __myfs_env_size(env),
+                       &__myfs_errno,
+                       MYFS_NUM(ino),
+                       nlookup);
+  fuse_reply_none(req);
+}
+
+static void __myfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct stat st;
+  int __myfs_errno, res;
+
+  (void) fi;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  __myfs_errno = ENOENT;
+  res = __myfs_getattrfh_implem(env->memory,
+                                __myfs_env_size(env),
+                                &__myfs_errno,
+                                env->uid,
+                                env->gid,
+                                MYFS_NUM(ino),
+                                &st);
+  if (res < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, env->attr_timeout);
+}
+
+/* Carries out truncate and utimens, the only attributes MyFS keeps, and
+   replies with the attributes that result. 
+*/
+static void __myfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                              int to_set, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct stat st;
+  struct timespec ts[2], now;
+  int __myfs_errno, res;
+
+  (void) fi;
+
+  /* As with paths, there is no chmod or chown */
+  if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+    fuse_reply_err(req, ENOSYS);
+    return;
+  }
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  __myfs_errno = ENOENT;
+  res = 0;
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    res = __myfs_truncatefh_implem(env->memory,
+                                   __myfs_env_size(env),
+                                   &__myfs_errno,
+                                   MYFS_NUM(ino),
+                                   attr->st_size);
+  }
+  if ((res >= 0) &&
+      (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+                 FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))) {
+    /* Times not being set are kept */
+    res = __myfs_getattrfh_implem(env->memory,
+                                  __myfs_env_size(env),
+                                  &__myfs_errno,
+                                  env->uid,
+                                  env->gid,
+                                  MYFS_NUM(ino),
+                                  &st);
+    if (res >= 0) {
+      clock_gettime(CLOCK_REALTIME, &now);
+      ts[0] = st.st_atim;
+      ts[1] = st.st_mtim;
+      if (to_set & FUSE_SET_ATTR_ATIME_NOW) ts[0] = now;
+      else if (to_set & FUSE_SET_ATTR_ATIME) ts[0] = attr->st_atim;
+      if (to_set & FUSE_SET_ATTR_MTIME_NOW) ts[1] = now;
+      else if (to_set & FUSE_SET_ATTR_MTIME) ts[1] = attr->st_mtim;
+      res = __myfs_utimensfh_implem(env->memory,
+                                    __myfs_env_size(env),
+                                    &__myfs_errno,
+                                    MYFS_NUM(ino),
+                                    ts);
+    }
+  }
+  if (res >= 0) {
+    res = __myfs_getattrfh_implem(env->memory,
+                                  __myfs_env_size(env),
+                                  &__myfs_errno,
+                                  env->uid,
+                                  env->gid,
+                                  MYFS_NUM(ino),
+                                  &st);
+  }
+  if (res < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, env->attr_timeout);
+}
+
+/* A reply buffer of directory entries, as filled by readdir */
+struct __myfs_ll_dirbuf {
+  fuse_req_t req;
+  char       *buf;
+  size_t     size;
+  size_t     pos;
+};
+
+/* Adds an entry to the directory buffer, unless it is full. Returns 1 if
+   it was full, so that listing stops, else 0.
+*/
+static int __myfs_ll_dirbuf_add(struct __myfs_ll_dirbuf *b, const char *name,
+                                const struct stat *st, off_t next) {
+  size_t len;
+  
+  len = fuse_add_direntry(b->req, b->buf + b->pos, b->size - b->pos, name, st, next);
+  if (len > b->size - b->pos) return 1;
+  b->pos += len;
+  return 0;
+}
+
+static int __myfs_ll_dirbuf_fill(void *ctx, const char *name, const struct stat *st, off_t next) {
+  struct stat entry;
+
+  entry = *st;
+  entry.st_ino = MYFS_INO(st->st_ino);
+  return __myfs_ll_dirbuf_add((struct __myfs_ll_dirbuf *) ctx, name, &entry, next + 2);
+}
+
+/* Lists a directory from the offset cookie on, as much as fits into size
+   bytes. Cookies 1 and 2 follow . and .., the others are the 
+   implementation's positions plus 2.
+*/
+static void __myfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                              off_t off, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_ll_dirbuf b;
+  struct stat st;
+  int __myfs_errno, res, full;
+
+  (void) fi;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  b.req = req;
+  b.size = size;
+  b.pos = 0;
+  b.buf = (char *) malloc(size);
+  if (b.buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  /* The kernel resolves .. itself, its inode number here is only a hint */
+  memset(&st, 0, sizeof(struct stat));
+  st.st_ino = ino;
+  st.st_mode = S_IFDIR;
+  full = 0;
+  if (off < 1) full = __myfs_ll_dirbuf_add(&b, ".", &st, 1);
+  if ((!full) && (off < 2)) full = __myfs_ll_dirbuf_add(&b, "..", &st, 2);
+  
+  __myfs_errno = ENOENT;
+  res = 0;
+  if (!full) {
+    res = __myfs_readdirfh_implem(env->memory,
+                                  __myfs_env_size(env),
+                                  &__myfs_errno,
+                                  env->uid,
+                                  env->gid,
+                                  MYFS_NUM(ino),
+                                  (off < 2) ? 0 : (off - 2),
+                                  __myfs_ll_dirbuf_fill,
+                                  &b);
+  }
+  if (res < 0) {
+    fuse_reply_err(req, __myfs_errno);
+  } else {
+    fuse_reply_buf(req, b.buf, b.pos);
+  }
+  free(b.buf);
+}
+
+static void __myfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                            mode_t mode, dev_t rdev) {
+  struct __myfs_environment_struct_t *env;
+  struct fuse_entry_param e;
+  int __myfs_errno, res;
+
+  (void) rdev;
+
+  if (!S_ISREG(mode)) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+  
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  memset(&e, 0, sizeof(struct fuse_entry_param));
+  
+  __myfs_maybe_grow(env, 0);
+  __myfs_errno = ENOENT;
+  res = __myfs_mknodat_implem(env->memory,
+                              __myfs_env_size(env),
+                              &__myfs_errno,
+                              env->uid,
+                              env->gid,
+                              MYFS_NUM(parent),
+                              name,
+                              &(e.attr));
+  if (res < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  __myfs_ll_reply_entry(req, &e);
+}
+
+static void __myfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+  struct __myfs_environment_struct_t *env;
+  struct fuse_entry_param e;
+  int __myfs_errno, res;
+
+  (void) mode;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  memset(&e, 0, sizeof(struct fuse_entry_param));
+  
+  __myfs_maybe_grow(env, 0);
+  __myfs_errno = ENOENT;
+  res = __myfs_mkdirat_implem(env->memory,
+                              __myfs_env_size(env),
+                              &__myfs_errno,
+                              env->uid,
+                              env->gid,
+                              MYFS_NUM(parent),
+                              name,
+                              &(e.attr));
+  if (res < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  __myfs_ll_reply_entry(req, &e);
+}
+
+static void __myfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  __myfs_errno = ENOENT;
+  res = __myfs_unlinkat_implem(env->memory,
+                               __myfs_env_size(env),
+                               &__myfs_errno,
+                               MYFS_NUM(parent),
+                               name);
+  fuse_reply_err(req, (res < 0) ? __myfs_errno : 0);
+}
+
+static void __myfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  __myfs_errno = ENOENT;
+  res = __myfs_rmdirat_implem(env->memory,
+                              __myfs_env_size(env),
+                              &__myfs_errno,
+                              MYFS_NUM(parent),
+                              name);
+  fuse_reply_err(req, (res < 0) ? __myfs_errno : 0);
+}
+
+static void __myfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                             fuse_ino_t newparent, const char *newname) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  __myfs_errno = ENOENT;
+  res = __myfs_renameat_implem(env->memory,
+                               __myfs_env_size(env),
+                               &__myfs_errno,
+                               MYFS_NUM(parent),
+                               name,
+                               MYFS_NUM(newparent),
+                               newname);
+  fuse_reply_err(req, (res < 0) ? __myfs_errno : 0);
+}
+
+static void __myfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  if (!(((fi->flags & O_ACCMODE) == O_RDONLY) ||
+        ((fi->flags & O_ACCMODE) == O_WRONLY) ||
+        ((fi->flags & O_ACCMODE) == O_RDWR)) ||
+      (fi->flags & O_TRUNC)) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  __myfs_errno = ENOENT;
+  res = __myfs_hold_implem(env->memory,
+                           __myfs_env_size(env),
+                           &__myfs_errno,
+                           MYFS_NUM(ino));
+  if (res < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  fi->fh = MYFS_NUM(ino);
+  fi->keep_cache = env->keep_cache;
+  
+  /* An interrupted open is never released by the kernel */
+  if (fuse_reply_open(req, fi) != 0) {
+    __myfs_release_implem(env->memory,
+                          __myfs_env_size(env),
+                          &__myfs_errno,
+                          fi->fh);
+  }
+}
+
+static void __myfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  (void) ino;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  __myfs_errno = EBADF;
+  res = __myfs_release_implem(env->memory,
+                              __myfs_env_size(env),
+                              &__myfs_errno,
+                              fi->fh);
+  fuse_reply_err(req, (res < 0) ? __myfs_errno : 0);
+}
+
+#if FUSE_VERSION < 29
+static void __myfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t off, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  char *buf;
+  int __myfs_errno, res;
+
+  (void) ino;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  buf = (char *) malloc(size);
+  if ((buf == NULL) && (size != ((size_t) 0))) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  __myfs_errno = EBADF;
+  res = __myfs_readfh_implem(env->memory,
+                             __myfs_env_size(env),
+                             &__myfs_errno,
+                             fi->fh,
+                             buf,
+                             size,
+                             off);
+  if (res < 0) {
+    fuse_reply_err(req, __myfs_errno);
+  } else {
+    fuse_reply_buf(req, buf, (size_t) res);
+  }
+  free(buf);
+}
+#endif
+
+static void __myfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                            size_t size, off_t off, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  (void) ino;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  __myfs_maybe_grow(env, size);
+  __myfs_errno = EBADF;
+  res = __myfs_writefh_implem(env->memory,
+                              __myfs_env_size(env),
+                              &__myfs_errno,
+                              fi->fh,
+                              buf,
+                              size,
+                              off);
+  if (res < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  fuse_reply_write(req, (size_t) res);
+}
+
+#if FUSE_VERSION >= 29
+struct __myfs_ll_read_ctx {
+  fuse_req_t                         req;
+  struct __myfs_environment_struct_t *env;
+};
+
+static int __myfs_ll_read_reply(void *ctx, const struct iovec *segs, int nsegs) {
+  struct __myfs_ll_read_ctx *c;
+  struct fuse_bufvec *bufv;
+
+  c = (struct __myfs_ll_read_ctx *) ctx;
+  bufv = __myfs_bufvec_new(c->env, segs, nsegs);
+  if (bufv == NULL) return ENOMEM;
+  fuse_reply_data(c->req, bufv, FUSE_BUF_SPLICE_MOVE);
+  free(bufv);
+  return 0;
+}
+
+/* Replies with the file's bytes straight from the memory map (or spliced
+   from the backup-file), while the implementation holds the file's lock.
+*/
+static void __myfs_ll_read_buf(fuse_req_t req, fuse_ino_t ino, size_t size,
+                               off_t off, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_ll_read_ctx c;
+  int __myfs_errno, res;
+
+  (void) ino;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  c.req = req;
+  c.env = env;
+  __myfs_errno = EBADF;
+  res = __myfs_readbuf_implem(env->memory,
+                              __myfs_env_size(env),
+                              &__myfs_errno,
+                              fi->fh,
+                              size,
+                              off,
+                              __myfs_ll_read_reply,
+                              &c);
+  if (res < 0)
+    fuse_reply_err(req, __myfs_errno);
+}
+
+static void __myfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                                off_t off, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+  size_t size;
+
+  (void) ino;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  size = fuse_buf_size(bufv);
+  __myfs_maybe_grow(env, size);
+  __myfs_errno = EBADF;
+  res = __myfs_writebuf_implem(env->memory,
+                               __myfs_env_size(env),
+                               &__myfs_errno,
+                               fi->fh,
+                               size,
+                               off,
+                               __myfs_bufvec_fill,
+                               bufv);
+  if (res < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  fuse_reply_write(req, (size_t) res);
+}
+#endif
+
+static void __myfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+  struct __myfs_environment_struct_t *env;
+  struct statvfs stbuf;
+  int __myfs_errno, res;
+
+  (void) ino;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  memset(&stbuf, 0, sizeof(struct statvfs));
+  
+  __myfs_errno = ENOENT;
+  res = __myfs_statfs_implem(env->memory,
+                             __myfs_env_size(env),
+                             &__myfs_errno,
+                             &stbuf);
+  if (res < 0) {
+    fuse_reply_err(req, __myfs_errno);
+    return;
+  }
+  fuse_reply_statfs(req, &stbuf);
+}
+
+static void __myfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                            struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  int res;
+
+  (void) ino;
+  (void) datasync;
+  (void) fi;
+
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  pthread_mutex_lock(&(env->env_lock));
+  res = __myfs_sync_group(env, 1);
+  pthread_mutex_unlock(&(env->env_lock));
+  fuse_reply_err(req, (res < 0) ? EIO : 0);
+}
+
+static void __myfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+#if FUSE_VERSION >= 29
+  __myfs_want_splice(conn);
+#endif
+
+  if (userdata != NULL) {
+    __myfs_tune_conn((struct __myfs_environment_struct_t *) userdata, conn);
+    __myfs_start_flusher((struct __myfs_environment_struct_t *) userdata);
+  }
+}
+
+static struct fuse_lowlevel_ops __myfs_ll_operations = {
+  .lookup = __myfs_ll_lookup,
+  .forget = __myfs_ll_forget,
+  .getattr = __myfs_ll_getattr,
+  .setattr = __myfs_ll_setattr,
+  .readdir = __myfs_ll_readdir,
+  .mknod = __myfs_ll_mknod,
+  .mkdir = __myfs_ll_mkdir,
+  .unlink = __myfs_ll_unlink,
+  .rmdir = __myfs_ll_rmdir,
+  .rename = __myfs_ll_rename,
+  .open = __myfs_ll_open,
+#if FUSE_VERSION >= 29
+  .read = __myfs_ll_read_buf,
+  .write_buf = __myfs_ll_write_buf,
+#else
+  .read = __myfs_ll_read,
+#endif
+  .write = __myfs_ll_write,
+  .release = __myfs_ll_release,
+  .statfs = __myfs_ll_statfs,
+  .fsync = __myfs_ll_fsync,
+  .init = __myfs_ll_init,
   .destroy = __myfs_destroy
 };
 
+/* Mounts and serves the file system through the low-level API, as 
+   fuse_main does through the high-level one.
+*/
+static int __myfs_ll_main(struct fuse_args *args, struct __myfs_environment_struct_t *env) {
+  struct fuse_session *se;
+  struct fuse_chan *ch;
+  char *mountpoint;
+  int multithreaded, foreground, err;
+
+  err = -1;
+  if ((fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) != -1) &&
+      ((ch = fuse_mount(mountpoint, args)) != NULL)) {
+    se = fuse_lowlevel_new(args, &__myfs_ll_operations, sizeof(__myfs_ll_operations), env);
+    if (se != NULL) {
+      if (fuse_set_signal_handlers(se) != -1) {
+        fuse_session_add_chan(se, ch);
+        if (fuse_daemonize(foreground) != -1) {
+          err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        }
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+  fuse_opt_free_args(args);
+  return err ? 1 : 0;
+}
+
+#endif /* MYFS_LOWLEVEL */
+
 /* End of FUSE operations part */
 
 static void __myfs_show_help(const char *name) {
@@ -662,9 +1920,42 @@ static void __myfs_show_help(const char *name) {
                "                            backup-file and the size specified.\n"
                "                            The minimum size of a filesystem is 2kB. If a\n"
                "                            lesser size is used, it is increased to 2kB.\n"
+               "    --max-size=<s>          Let the file system grow online as it fills,\n"
+               "                            up to this size, extending the backup-file.\n"
+               "                            Default: the size, no growing.\n"
+               "    --flush-interval=<n>    Write changes back to the backup-file every n\n"
+               "                            seconds, in the background.\n"
+               "                            Default: 0, only on fsync and unmount.\n"
+               "    --attr-timeout=<t>      Seconds the kernel may cache file attributes.\n"
+               "    --entry-timeout=<t>     Seconds the kernel may cache file names.\n"
+               "                            As the file system changes only through the\n"
+               "                            kernel, long timeouts are safe.\n"
+               "                            Default: 1\n"
+               "    --max-write=<s>         Largest write request the kernel sends.\n"
+               "                            Default: as large as libfuse allows (128kB).\n"
+               "    --max-read=<s>          Largest read request (and readahead) the kernel\n"
+               "                            sends. Default: no limit.\n"
+               "    --keep-cache            Keep file data cached by the kernel across opens.\n"
                "\n");
 }
 
+/* Passes the tuning options that libfuse applies at mount time on to it */
+static int __myfs_add_tuning_args(struct fuse_args *args, struct __myfs_environment_struct_t *env) {
+  char arg[64];
+
+#ifndef MYFS_LOWLEVEL
+  snprintf(arg, sizeof(arg), "-oattr_timeout=%g", env->attr_timeout);
+  if (fuse_opt_add_arg(args, arg) != 0) return 0;
+  snprintf(arg, sizeof(arg), "-oentry_timeout=%g", env->entry_timeout);
+  if (fuse_opt_add_arg(args, arg) != 0) return 0;
+#endif
+  if (env->max_read != ((size_t) 0)) {
+    snprintf(arg, sizeof(arg), "-omax_read=%zu", env->max_read);
+    if (fuse_opt_add_arg(args, arg) != 0) return 0;
+  }
+  return 1;
+}
+
 int main(int argc, char *argv[]) {
   struct __myfs_options_struct_t __myfs_options;
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
@@ -674,6 +1965,13 @@ int main(int argc, char *argv[]) {
   /* Initialize defaults */
   __myfs_options.filename = NULL;
   __myfs_options.size = NULL;
+  __myfs_options.max_size = NULL;
+  __myfs_options.flush_interval = NULL;
+  __myfs_options.attr_timeout = NULL;
+  __myfs_options.entry_timeout = NULL;
+  __myfs_options.max_write = NULL;
+  __myfs_options.max_read = NULL;
+  __myfs_options.keep_cache = 0;
   __myfs_options.show_help = 0;
         
   /* Parse options */
@@ -687,6 +1985,10 @@ int main(int argc, char *argv[]) {
     env_ptr = &__myfs_environment;
     if (!__myfs_setup_environment(env_ptr, &__myfs_options))
       return 1;
+    if (!__myfs_add_tuning_args(&args, env_ptr)) {
+      __myfs_clear_environment(env_ptr);
+      return 1;
+    }
   } else {
     /* Handle displaying of help text */
     __myfs_show_help(argv[0]);
@@ -694,5 +1996,9 @@ int main(int argc, char *argv[]) {
     args.argv[0] = (char*) "";
   }
   
+#ifdef MYFS_LOWLEVEL
+  return __myfs_ll_main(&args, env_ptr);
+#else
   return fuse_main(args.argc, args.argv, &__myfs_operations, env_ptr);
+#endif
 }
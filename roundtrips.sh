@@ -0,0 +1,68 @@
+#!/bin/bash
+
+# Counts the FUSE requests (round trips to the file system) that ls -lR and
+# cp -r cause on a MyFS mount, once with the kernel's default caching and
+# once with the caching options, from the request trace libfuse prints in
+# debug mode (-d).
+#
+#   ./roundtrips.sh [myfs binary] [directory to copy in]
+#
+# Defaults: ./myfs and /usr/include. Needs fusermount (or root).
+
+MYFS=${1:-./myfs}
+SRC=${2:-/usr/include}
+SIZE=$((1024 * 1024 * 1024))
+TUNED="--attr-timeout=3600 --entry-timeout=3600 --keep-cache"
+
+if ! [ -x "$MYFS" ]; then
+	echo "error, $MYFS is not executable" >&2
+	exit 1
+fi
+
+# Prints the num of requests in lines $2.. of trace $1, by type
+count() {
+	tail -n +"$2" "$1" | sed -n 's/.*opcode: \([A-Z_]*\).*/\1/p' | sort | uniq -c |
+		awk '{ total += $1; printf "%s=%s ", $2, $1 } END { printf "total=%d\n", total }'
+}
+
+run() {
+	local name=$1 opts=$2 mnt log out from
+	mnt=$(mktemp -d)
+	out=$(mktemp -d)
+	log=$(mktemp)
+
+	$MYFS $opts --size=$SIZE "$mnt" -f -d 2> "$log" &
+	for i in $(seq 50); do
+		grep -q " $mnt " /proc/mounts && break
+		sleep 0.1
+	done
+	if ! grep -q " $mnt " /proc/mounts; then
+		echo "error, cannot mount $MYFS" >&2
+		exit 1
+	fi
+
+	# MyFS has no symbolic links, so these are copied in as what they name
+	from=$(($(wc -l < "$log") + 1))
+	cp -rL "$SRC" "$mnt/tree"
+	sync
+	echo "$name cp -r in: $(count "$log" $from)"
+
+	for pass in 1 2; do
+		from=$(($(wc -l < "$log") + 1))
+		ls -lR "$mnt/tree" > /dev/null
+		echo "$name ls -lR (pass $pass): $(count "$log" $from)"
+	done
+	for pass in 1 2; do
+		from=$(($(wc -l < "$log") + 1))
+		rm -rf "$out/tree"
+		cp -r "$mnt/tree" "$out/tree"
+		echo "$name cp -r out (pass $pass): $(count "$log" $from)"
+	done
+
+	fusermount -u "$mnt" 2> /dev/null || umount "$mnt"
+	wait
+	rm -rf "$mnt" "$out" "$log"
+}
+
+run default ""
+run tuned "$TUNED"
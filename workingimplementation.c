@@ -51,6 +51,9 @@
 #include <errno.h>
 #include <stdio.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 
 /* Begin Configurables  -------------------------------------------------- */
@@ -58,7 +61,12 @@
 
 #define FS_BLOCK_SZ_KB (4)                 // Total kbs of each memory block
 #define NAME_MAXLEN (256)                  // Max length of any filename
-#define BLOCKS_TO_INODES (1)               // Num of mem blocks to each inode
+#define INODE_EXTENTS (2)                  // Num extents kept inside an inode
+#define DCACHE_SLOTS (4096)                // Num entries in path lookup cache
+#define DCACHE_PATH_MAXLEN (128)           // Longest path the cache will hold
+#define DCACHE_LOCKS (64)                  // Num locks striping lookup cache
+#define INODE_LOCKS (64)                   // Num rwlocks striping the inodes
+#define JOURNAL_MAXBLKS (1025)             // Max blocks in journal, incl. head
 
 
 /* End Configurables  ---------------------------------------------------- */
@@ -67,63 +75,234 @@
 
 #define BYTES_IN_KB (1024)                  // Num bytes in a kb
 #define FS_PATH_SEP ("/")                   // File system's path seperator
-#define FS_DIRDATA_SEP (":")                // Dir data name/offset seperator
-#define FS_DIRDATA_END ("\n")               // Dir data name/offset end char
-#define MAGIC_NUM (UINT32_C(0xdeadd0c5))    // Num for denoting block init
+#define MAGIC_NUM (UINT32_C(0xdeadd0cc))    // Num for denoting block init
+
+// Extent -
+// A run of len physically contiguous memory blocks, starting at block pblk,
+// holding the file's logical blocks lblk through lblk + len - 1.
+typedef struct Extent {
+    uint32_t lblk;                      // First logical (file) block of run
+    uint32_t pblk;                      // First physical block of run
+    uint32_t len;                       // Num blocks in the run
+} Extent;
 
 // Inode -
-// An Inode represents the meta-data of a file or folder.
+// An Inode represents the meta-data of a file or folder, in a 64 byte record.
+// Its name is kept in the name heap. While free, it is instead linked into the
+// free inodes list by next_free, and likewise into the orphan list while it 
+// is unlinked but still open (it keeps its data until closed). Its data 
+// lives in the memory blocks given by its extent map, kept sorted by lblk.
+// Logical blocks no extent maps are holes, which read as zeros. Up to 
+// INODE_EXTENTS extents are stored in the inode itself. Past that 
+// (is_indirect), the whole map moves to an indirect run of extblk_n 
+// contiguous blocks at extblk. A small file keeps its data inline instead:
+// up to INODE_INLINE_MAX bytes in the space of the map (INLINE_INODE), and 
+// up to INLINE_HEAP_MAX bytes in a slot of the name heap, whose ref and size
+// class that space then holds (INLINE_HEAP). It moves to a larger slot, then
+// to blocks, as it grows.
+#define INODE_INLINE_MAX (INODE_EXTENTS * sizeof(Extent))
+#define INLINE_INODE (1)
+#define INLINE_HEAP (2)
+
 typedef struct Inode { 
-    char name[NAME_MAXLEN];             // Inode's label (file/folder name)
-    int *is_dir;                        // if 1, is a dir, else a file
-    int *subdirs;                       // Subdir count (unused if not is_dir)
-    size_t *file_size_b;                // File's/folder's data size, in bytes
-    struct timespec *last_acc;          // File/folder last access time
-    struct timespec *last_mod;          // File/Folder last modified time
-    size_t *offset_firstblk;            // Byte offset from fsptr to 1st
-                                        // memblock, or 0 if inode is unused
+    union {
+        uint32_t name;                  // Name's ref in the name heap (or 0)
+        uint32_t next_free;             // Next free (or orphan) inode's num
+    };
+    uint8_t not_free;                   // Denotes inode in use (1 = used)
+    uint8_t is_dir;                     // if 1, is a dir, else a file
+    uint8_t is_inline;                  // If set, where data is (INLINE_*)
+    uint8_t is_indirect;                // If 1, extent map is at extblk
+    int32_t subdirs;                    // Subdir count (unused if not is_dir)
+    uint32_t num_extents;               // Num extents in the extent map
+    uint64_t file_size_b;               // File's/folder's data size, in bytes
+    int64_t last_acc;                   // Last access time, ns since epoch
+    int64_t last_mod;                   // Last modified time, ns since epoch
+    union {
+        Extent extents[INODE_EXTENTS];  // Extent map, if not indirect
+        struct {
+            uint32_t extblk;            // First block of indirect extent run
+            uint32_t extblk_n;          // Num blocks in indirect run
+        };
+        struct {
+            uint32_t heap_ref;          // Slot holding the file's data, and
+            uint32_t heap_class;        // its size class, if INLINE_HEAP
+        };
+        char inline_data[INODE_INLINE_MAX]; // File's data, if INLINE_INODE
+        uint32_t parent;                // Parent dir's num, if a dir w/o table
+    };
 } Inode;
 
-// Memory block header -
-// Each file/dir uses one or more memory blocks.
-typedef struct MemHead {
-    int *not_free;                      // Denotes memblock in use (1 = used)
-    size_t *data_size_b;                // Size of data field occupied
-    size_t *offset_nextblk;             // Bytes offset (from fsptr) to next
-                                        // memblock, if any (else 0)
-} MemHead;
+_Static_assert(sizeof(Inode) <= 64, "Inode must fit a 64 byte record");
+
+// Inode group -
+// Inodes are allocated on demand from the data blocks, a block of them (an 
+// inode group) at a time. The inode map, a run of imap_blks blocks at imap_blk,
+// holds the block num of each group in order, so inode num i is record
+// i % INODES_PER_BLK of group i / INODES_PER_BLK. The map grows by moving to a
+// doubled run. A group's first record holds its group num instead, so an 
+// inode's num can be found from its address.
+typedef struct InodeBlock {
+    uint32_t group;                     // Group num (index in the inode map)
+    char reserved[sizeof(Inode) - sizeof(uint32_t)];
+    Inode inodes[];                     // The group's inodes
+} InodeBlock;
+
+// Directory table -
+// A directory's data is an open-addressing hash table of DirEntry slots,
+// keyed by the hash of each child's name and probed linearly, preceded by a 
+// DirHead. A child's name is kept by its own inode, so entries are fixed-size.
+// An empty directory has no table (zero data size). A directory's parent's 
+// inode num is kept in its DirHead, or in its inode while it has no table.
+typedef struct DirHead {
+    uint32_t num_slots;                 // Num slots in table (a power of 2)
+    uint32_t num_entries;               // Num slots holding a child
+    uint32_t num_tombs;                 // Num slots of removed children
+    uint32_t parent;                    // Parent dir's num (root's is its own)
+} DirHead;
+
+typedef struct DirEntry {
+    uint32_t hash;                      // Hash of the child's name
+    uint32_t inode;                     // Child's inode num, or a DIRENT_* 
+} DirEntry;
+
+#define DIRENT_FREE (0)                 // Slot never used (root isn't a child)
+#define DIRENT_TOMB (UINT32_MAX)        // Slot's child was removed
+#define DIR_MIN_SLOTS (256)             // Num slots of a new dir table
+
+// Name heap -
+// Names live apart from the inodes, in slots carved from data blocks on 
+// demand. Each heap block holds slots of a single size class c (NAME_GRAIN << c
+// bytes), and the free slots of each class are chained through their first 4
+// bytes from the handle's names_free[c]. A slot is referred to by its byte
+// offset / NAME_GRAIN (so images are limited to NAME_MAX_BLKS blocks), and 0 
+// refers to the root's name. Heap blocks are not returned to free space. 
+// Small files' data is kept in its slots too (see Inode).
+#define NAME_GRAIN (16)
+#define NAME_CLASSES (5)                // Slots of 16 to 256 bytes
+#define INLINE_HEAP_MAX (NAME_GRAIN << (NAME_CLASSES - 1))
+#define NAME_MAX_BLKS ((size_t)UINT32_MAX / (MEMBLOCK_SZ_B / NAME_GRAIN))
+
+// Journal -
+// An undo journal of metadata blocks. Before a metadata block is first changed
+// after a checkpoint (a sync), its contents are copied to the journal and made
+// durable. After a crash, copying them back returns all metadata to its state
+// at the last checkpoint. The journal's first block holds the home block num 
+// + 1 of each copy, ending at the first 0. The copies follow, in order.
+#define JOURNAL_HEAD_CAP (MEMBLOCK_SZ_B / sizeof(uint32_t))
 
 // Top-level filesystem handle
-// A file system is a list of inodes where each knows the offset of the first 
-// memory block for that file/dir.
+// A file system is a list of inodes where each knows the extents holding the
+// data for that file/dir. The image is addressed in memory blocks: block 0 
+// holds this handle, followed by the free-space bitmap (one bit per block, 
+// set if in use), the journal and then the data blocks, which also hold the
+// inode map and inode groups. Segment locations are stored as offsets, so 
+// the image can be mapped at any address. When the image is grown, blocks 
+// are added at its end, and a bitmap outgrowing its blocks moves there.
 typedef struct FSHandle {
     uint32_t magic;                     // Magic number for denoting mem init
-    size_t size_b;                      // Bytes from inode seg to memblocks end
-    size_t num_inodes;                  // Num inodes the file system contains
-    size_t num_memblocks;               // Num memory blocks the fs contains
-    struct Inode *inode_seg;            // Ptr to start of inodes segment
-    struct MemHead *mem_seg;            // Ptr to start of mem blocks segment
+    size_t size_b;                      // Bytes from fsptr to memblocks end
+    size_t num_inodes;                  // Num inodes in the inode groups
+    size_t num_memblocks;               // Num memory blocks (incl. metadata)
+    size_t imap_blk;                    // First block of the inode map run
+    size_t imap_blks;                   // Num blocks in the inode map run
+    size_t offset_blkmap;               // Byte offset to the block bitmap
+    size_t blkmap_blks;                 // Num blocks holding the bitmap
+    size_t offset_journal;              // Byte offset to the journal
+    size_t journal_blks;                // Num blocks in journal, incl. head
+    size_t first_datablk;               // Num of the first data block
+    size_t alloc_hint;                  // Block after the last allocated run
+    size_t blocks_free;                 // Num data blocks not in use
+    size_t inodes_free;                 // Num inodes not in use
+    uint32_t inodes_next;               // First free inode's num (or 0)
+    uint32_t names_free[NAME_CLASSES];  // Free name slots, by size class
+    uint32_t orphans;                   // First unlinked, open inode's num
 } FSHandle;
 
+// Lookup cache entry -
+// Maps a full path to its inode num. An entry is valid only if made in the
+// cache's current generation, so the whole cache is flushed by a gen bump.
+typedef struct DCacheEntry {
+    uint32_t gen;                       // Cache generation entry was made in
+    uint32_t inode;                     // Inode num the path resolves to
+    char path[DCACHE_PATH_MAXLEN];      // Full path, to rule out collisions
+} DCacheEntry;
+
+// A run of len memory blocks starting at blk, freed but not yet reusable
+typedef struct BlockRun {
+    size_t blk;
+    size_t len;
+} BlockRun;
+
 typedef long unsigned int lui;          // For shorthand convenience in casting
 static Inode* resolve_path(FSHandle *fs, const char *path);  // Prototype
 
+// Process-local state -
+// Kept in DRAM only, never in the fs image.
+// Locking: ns_lock guards the namespace (dir tables, names, inode use). It is
+// held shared by every op, and exclusively by ops changing the namespace.
+// Under it, a file's data and attributes are guarded by its (striped) inode
+// lock, the name heap's free lists by heap_lock, and the free-space bitmap 
+// and free counts by alloc_lock. Locks are always taken in that order, then
+// journal_lock. The lookup cache has its own
+// striped locks, and the open handle counts open_lock. A checkpoint holds 
+// ns_lock exclusively, and sync_lock (taken before it) so that it never runs
+// during a sync, whose blocks taken for writing back it would not see.
+static void *fs_mounted = NULL;         // fsptr of the image last mounted
+static pthread_mutex_t mount_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t ns_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t inode_locks[INODE_LOCKS];
+static pthread_mutex_t dcache_locks[DCACHE_LOCKS];
+static pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+static uint64_t *dirty_map = NULL;      // 1 bit per block, set if unsynced
+static uint64_t *epoch_map = NULL;      // 1 bit per block, set if its state 
+                                        // at the last checkpoint is safe
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t journal_num = 0;          // Num copies in the journal
+static int journal_warned = 0;          // Full journal reported this epoch
+static BlockRun *frees = NULL;          // Runs freed since the last checkpoint
+static size_t frees_num = 0;            // Num runs in frees
+static size_t frees_cap = 0;            // Num runs frees has room for
+static size_t frees_blks = 0;           // Num blocks in frees
+static DCacheEntry dcache[DCACHE_SLOTS]; // Path lookup cache
+static uint32_t dcache_gen = 1;         // Current lookup cache generation
+static size_t dcache_hits = 0;          // Num lookups served by the cache
+static size_t dcache_misses = 0;        // Num lookups that walked the path
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t *open_counts = NULL;    // Num open handles, by inode num, 
+                                        // | INODE_ORPHANED once unlinked
+static size_t open_cap = 0;             // Num inodes open_counts covers
+
 // Size in bytes of the filesystem's structs (above)
 #define ST_SZ_INODE sizeof(Inode)
-#define ST_SZ_MEMHEAD sizeof(MemHead)
+#define ST_SZ_EXTENT sizeof(Extent)
+#define ST_SZ_DIRHEAD sizeof(DirHead)
+#define ST_SZ_DIRENTRY sizeof(DirEntry)
 #define ST_SZ_FSHANDLE sizeof(FSHandle)  
 
-// Size of each memory block's data field
-#define DATAFIELD_SZ_B (FS_BLOCK_SZ_KB * BYTES_IN_KB - sizeof(MemHead))    
+// Memory block size. Blocks carry no header, all bytes hold data.
+#define MEMBLOCK_SZ_B (FS_BLOCK_SZ_KB * BYTES_IN_KB)
+#define DATAFIELD_SZ_B MEMBLOCK_SZ_B
 
-// Memory block size = MemHead + data field of size DATAFIELD_SZ_B
-#define MEMBLOCK_SZ_B sizeof(MemHead) + DATAFIELD_SZ_B
+// Num extents that fit in one memory block of an indirect extent run
+#define EXTENTS_PER_BLOCK (MEMBLOCK_SZ_B / ST_SZ_EXTENT)
 
-// Min requestable fs size = FSHandle + 1 inode + root dir block + 1 free block
-#define MIN_FS_SZ_B sizeof(FSHandle) + sizeof(Inode) + (2 * MEMBLOCK_SZ_B) 
+// Num inodes in an inode group, and num groups one inode map block holds
+#define INODES_PER_BLK (MEMBLOCK_SZ_B / ST_SZ_INODE - 1)
+#define IMAP_PER_BLK (MEMBLOCK_SZ_B / sizeof(uint32_t))
 
-// Offset in bytes from fsptr to start of inodes segment
-#define FS_START_OFFSET sizeof(FSHandle)
+// Flag in an inode's open handle count, set once it is unlinked while open
+#define INODE_ORPHANED (UINT32_C(1) << 31)
+
+// Min requestable fs size = FSHandle + map + 2 journal + inode map 
+//                           + inode group + root dir + 1 free block
+#define MIN_FS_SZ_B (8 * MEMBLOCK_SZ_B)
+
+// Offset in bytes from fsptr to the segment after the FSHandle (the bitmap)
+#define FS_START_OFFSET MEMBLOCK_SZ_B
 
 
 /* End FS Definitions ----------------------------------------------------- */
@@ -131,13 +310,13 @@ static Inode* resolve_path(FSHandle *fs, const char *path);  // Prototype
 
 
 // Returns a ptr to a mem address in the file system given an offset.
-static void* ptr_from_offset(FSHandle *fs, size_t *offset) {
-    return (void*)((long unsigned int)fs + (size_t)offset);
+static void* ptr_from_offset(FSHandle *fs, size_t offset) {
+    return (void*)((char*)fs + offset);
 }
 
 // Returns an int offset from the filesystem's start address for the given ptr.
 static size_t offset_from_ptr(FSHandle *fs, void *ptr) {
-    return ptr - (void*)fs;
+    return (char*)ptr - (char*)fs;
 }
 
 // Returns the given number of kilobytes converted to bytes.
@@ -162,110 +341,659 @@ int is_kb_blockaligned(size_t kbs_size, size_t block_sz) {
     return is_bytes_blockalignable(kb_to_bytes(kbs_size), block_sz);
 }
 
+// Returns the num of memory blocks needed to hold the given num of bytes.
+static size_t bytes_to_blocks(size_t bytes) {
+    return (bytes + MEMBLOCK_SZ_B - 1) / MEMBLOCK_SZ_B;
+}
+
 /* End ptr/bytes helpers -------------------------------------------------- */
-/* Begin Memblock helpers ------------------------------------------------- */
+/* Begin Lock helpers ----------------------------------------------------- */
 
 
-// Returns a ptr to a memory block's data field.
-static void* memblock_datafield(FSHandle *fs, MemHead *memblock){
-    return (void*)(memblock + ST_SZ_MEMHEAD);
+// Initializes the striped lock tables. Run once, through locks_once.
+static void locks_init() {
+    for (size_t i = 0; i < INODE_LOCKS; i++)
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    for (size_t i = 0; i < DCACHE_LOCKS; i++)
+        pthread_mutex_init(&dcache_locks[i], NULL);
 }
 
-// Returns 1 if the given memory block is free, else returns 0.
-static int memblock_isfree(MemHead *memhead) {
-    if (memhead->not_free == 0)
+// Takes the namespace lock, exclusively if excl (to change the namespace).
+static void fs_lock_ns(int excl) {
+    if (excl)
+        pthread_rwlock_wrlock(&ns_lock);
+    else
+        pthread_rwlock_rdlock(&ns_lock);
+}
+
+// Releases the namespace lock.
+static void fs_unlock_ns() {
+    pthread_rwlock_unlock(&ns_lock);
+}
+
+
+/* End Lock helpers ------------------------------------------------------- */
+/* Begin Dirty tracking helpers ------------------------------------------- */
+
+
+// Marks the memory blocks first through end - 1 as changed since the last
+// sync. Only these blocks are written back by __myfs_sync_implem.
+// Note: Call after the change is stored, so a sync racing with the change
+// either writes it or leaves the blocks marked for the next sync.
+static void fs_dirty_blocks(size_t first, size_t end) {
+    if (!dirty_map)
+        return;     // Untracked, a sync writes back everything
+
+    while (first < end) {
+        size_t bit = first % 64;
+        size_t cnt = (64 - bit < end - first) ? 64 - bit : end - first;
+        uint64_t mask = (cnt == 64) ? ~UINT64_C(0) 
+                                    : ((UINT64_C(1) << cnt) - 1) << bit;
+        __atomic_fetch_or(&dirty_map[first / 64], mask, __ATOMIC_RELEASE);
+        first += cnt;
+    }
+}
+
+// Marks the memory blocks holding the len bytes at ptr as changed.
+static void fs_dirty(FSHandle *fs, const void *ptr, size_t len) {
+    size_t offset = offset_from_ptr(fs, (void*)ptr);
+
+    if (len)
+        fs_dirty_blocks(offset / MEMBLOCK_SZ_B, 
+                        (offset + len - 1) / MEMBLOCK_SZ_B + 1);
+}
+
+// Allocates a clean dirty map and a fresh epoch map for the given (just 
+// mounted) file system. If formatted, no checkpoint exists yet, so all blocks
+// are safe. If there is no memory for a map, changes go untracked or 
+// unjournaled.
+// Assumes: mount_lock is held.
+static void fs_dirty_init(FSHandle *fs, int formatted) {
+    size_t map_sz = (fs->num_memblocks + 63) / 64 * sizeof(uint64_t);
+
+    free(dirty_map);
+    free(epoch_map);
+    dirty_map = calloc(1, map_sz);
+    if ((epoch_map = calloc(1, map_sz)) && formatted)
+        memset(epoch_map, 0xff, map_sz);
+    else if (!epoch_map)
+        printf("ERROR: No memory for journaling, metadata is not crash-safe\n");
+}
+
+
+// Writes back the run of len dirty memory blocks starting at blk, by calling
+// flush(flushctx, offset, bytes), and adds the bytes to *flushed. If flush
+// fails, the blocks are marked again so the next sync retries them.
+// Returns: 1 on success, else 0.
+static int fs_dirty_flush(int (*flush)(void *, size_t, size_t), 
+                          void *flushctx, size_t blk, size_t len, 
+                          size_t *flushed) {
+    if (flush(flushctx, blk * MEMBLOCK_SZ_B, len * MEMBLOCK_SZ_B) != 0) {
+        fs_dirty_blocks(blk, blk + len);
+        return 0;
+    }
+    *flushed += len * MEMBLOCK_SZ_B;
+    return 1;
+}
+
+
+// Writes back all blocks marked as changed, as runs passed to flush. If the
+// changes went untracked, the whole image is passed as a single run.
+// Returns: 1 on success, else 0 (runs that failed are kept marked).
+static int fs_dirty_flushall(FSHandle *fs, int (*flush)(void *, size_t, size_t),
+                             void *flushctx, size_t *flushed) {
+    size_t run_start = 0, run_len = 0;  // Run of dirty blocks being built
+    int failed = 0;
+
+    if (!dirty_map) {
+        if (flush(flushctx, 0, fs->size_b) != 0)
+            return 0;
+        *flushed += fs->size_b;
         return 1;
-    return 0;
+    }
+
+    // Take and clear each word of the map, joining its runs of set bits into
+    // the run being built when adjacent, else flushing that run first
+    size_t num_words = (fs->num_memblocks + 63) / 64;
+
+    for (size_t word = 0; word < num_words; word++) {
+        if (!__atomic_load_n(&dirty_map[word], __ATOMIC_RELAXED))
+            continue;
+        uint64_t bits = __atomic_exchange_n(&dirty_map[word], 0, 
+                                            __ATOMIC_ACQ_REL);
+
+        while (bits) {
+            size_t bit = __builtin_ctzll(bits);
+            uint64_t rest = ~(bits >> bit);
+            size_t ones = rest ? (size_t)__builtin_ctzll(rest) : 64 - bit;
+            size_t blk = word * 64 + bit;
+
+            if (run_len && run_start + run_len == blk) {
+                run_len += ones;
+            } else {
+                if (run_len && !fs_dirty_flush(flush, flushctx, run_start, 
+                                               run_len, flushed))
+                    failed = 1;
+                run_start = blk;
+                run_len = ones;
+            }
+            bits = (bit + ones >= 64) ? 0 
+                                      : bits >> (bit + ones) << (bit + ones);
+        }
+    }
+    if (run_len && !fs_dirty_flush(flush, flushctx, run_start, run_len, 
+                                   flushed))
+        failed = 1;
+
+    return !failed;
+}
+
+// Writes back the len bytes at offset bytes into the given filesystem's
+// image, widened to whole pages. Used as a flush callback for syncs made by 
+// the file system itself. Returns: 0 on success, else -1.
+static int fs_msync(void *fsptr, size_t offset, size_t len) {
+    uintptr_t page_sz = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)fsptr + offset;
+    uintptr_t page = start & ~(page_sz - 1);
+
+    return msync((void*)page, start + len - page, MS_SYNC);
+}
+
+
+/* End Dirty tracking helpers --------------------------------------------- */
+/* Begin Journal helpers ------------------------------------------------- */
+
+
+// Returns a ptr to the journal's head, which lists each copy's home block.
+static uint32_t* journal_head(FSHandle *fs) {
+    return (uint32_t*)ptr_from_offset(fs, fs->offset_journal);
+}
+
+// Returns the num of journal blocks, incl. the head, for a file system of 
+// n_blocks memory blocks.
+static size_t journal_size(size_t n_blocks) {
+    size_t blks = n_blocks / 32;
+
+    if (blks < 2)
+        blks = 2;
+    if (blks > JOURNAL_MAXBLKS)
+        blks = JOURNAL_MAXBLKS;
+    return blks;
+}
+
+// Returns the num of copies the journal has room for.
+static size_t journal_cap(FSHandle *fs) {
+    size_t cap = __atomic_load_n(&fs->journal_blks, __ATOMIC_RELAXED) - 1;
+    return (cap < JOURNAL_HEAD_CAP) ? cap : JOURNAL_HEAD_CAP;
 }
 
-// Returns the first free memblock in the given filesystem
-static MemHead* memblock_nextfree(FSHandle *fs) {
-    MemHead *memblock = fs->mem_seg;
-    size_t num_memblocks = fs->num_memblocks;
+// Returns 1 if the given block's state at the last checkpoint is safe, being
+// either in the journal or not in use then, else 0.
+static int journal_issafe(size_t blk) {
+    return (__atomic_load_n(&epoch_map[blk / 64], __ATOMIC_ACQUIRE) >> 
+            (blk % 64)) & 1;
+}
 
-    for (int i = 0; i < num_memblocks; i++)
-    {
-        if (memblock_isfree(memblock))
-            return memblock;
+// Marks the n blocks starting at blk as safe until the next checkpoint.
+static void journal_marksafe(size_t blk, size_t n) {
+    if (!epoch_map)
+        return;
+    for (size_t end = blk + n; blk < end; blk++)
+        __atomic_fetch_or(&epoch_map[blk / 64], UINT64_C(1) << (blk % 64), 
+                          __ATOMIC_RELEASE);
+}
 
-        memblock = (MemHead*)((size_t)memblock + MEMBLOCK_SZ_B);
+// Makes the state of the memory blocks first through end - 1 at the last 
+// checkpoint safe, copying those not yet safe to the journal, durably. 
+// Call before changing any metadata in the blocks. If the journal is full,
+// the change is made unjournaled (and reported once per epoch).
+static void fs_journal_blocks(FSHandle *fs, size_t first, size_t end) {
+    if (!epoch_map)
+        return;
+
+    for (size_t blk = first; blk < end; blk++) {
+        if (journal_issafe(blk))
+            continue;
+
+        pthread_mutex_lock(&journal_lock);
+        if (!journal_issafe(blk)) {
+            size_t rec = journal_num;
+            uint32_t *head = journal_head(fs);
+            size_t copy_off = fs->offset_journal + (rec + 1) * MEMBLOCK_SZ_B;
+
+            if (rec < journal_cap(fs)) {
+                // The copy must be durable before the head lists it
+                memcpy(ptr_from_offset(fs, copy_off), 
+                       ptr_from_offset(fs, blk * MEMBLOCK_SZ_B), MEMBLOCK_SZ_B);
+                fs_msync(fs, copy_off, MEMBLOCK_SZ_B);
+                head[rec] = blk + 1;
+                fs_msync(fs, fs->offset_journal, MEMBLOCK_SZ_B);
+                __atomic_store_n(&journal_num, rec + 1, __ATOMIC_RELAXED);
+            } else if (!journal_warned) {
+                printf("ERROR: Journal full, changes are not crash-safe "
+                       "until the next sync\n");
+                journal_warned = 1;
+            }
+            journal_marksafe(blk, 1);
+        }
+        pthread_mutex_unlock(&journal_lock);
     }
-    return NULL;
 }
 
-// Returns the number of free memblocks in the filesystem
-static size_t memblocks_numfree(FSHandle *fs) {
-    Inode *inode = fs->inode_seg;
-    size_t num_blocks = fs->num_memblocks;
-    size_t blocks_used = 0;
-    size_t node_bytes = 0;
+// Makes the state of the blocks holding the len bytes at ptr safe (see 
+// fs_journal_blocks). Call before changing metadata in those bytes.
+static void fs_journal(FSHandle *fs, const void *ptr, size_t len) {
+    size_t offset = offset_from_ptr(fs, (void*)ptr);
 
-    // Iterate each inode and determine number of blocks being used
-    for (int i = 0; i < fs->num_inodes; i++) {
-        node_bytes = *(size_t*)(&inode->file_size_b);
+    if (len)
+        fs_journal_blocks(fs, offset / MEMBLOCK_SZ_B, 
+                          (offset + len - 1) / MEMBLOCK_SZ_B + 1);
+}
 
-        if (node_bytes % DATAFIELD_SZ_B > 0)
-            blocks_used += 1;
-        blocks_used += node_bytes / DATAFIELD_SZ_B; // Note: integer division
+// Empties the journal, starting a new epoch in which no block is safe.
+// Assumes: All changes are durable and ns_lock is held exclusively.
+static void journal_reset(FSHandle *fs) {
+    pthread_mutex_lock(&journal_lock);
+    if (journal_num) {
+        memset(journal_head(fs), 0, journal_num * sizeof(uint32_t));
+        fs_msync(fs, fs->offset_journal, MEMBLOCK_SZ_B);
+    }
+    __atomic_store_n(&journal_num, 0, __ATOMIC_RELAXED);
+    journal_warned = 0;
+    if (epoch_map)
+        memset(epoch_map, 0, (fs->num_memblocks + 63) / 64 * sizeof(uint64_t));
+    pthread_mutex_unlock(&journal_lock);
+}
 
-        inode++;
+// Copies each block in the journal back to its home block, undoing all 
+// metadata changes made after the last checkpoint, then empties the journal.
+// Replaying again after a crash during replay is harmless.
+// Assumes: mount_lock is held, and no other use of the image is made.
+static void journal_replay(FSHandle *fs) {
+    uint32_t *head = journal_head(fs);
+    size_t n = 0;
+
+    for (; n < journal_cap(fs) && head[n]; n++) {
+        size_t home_off = (size_t)(head[n] - 1) * MEMBLOCK_SZ_B;
+        size_t copy_off = fs->offset_journal + (n + 1) * MEMBLOCK_SZ_B;
+
+        memcpy(ptr_from_offset(fs, home_off), ptr_from_offset(fs, copy_off),
+               MEMBLOCK_SZ_B);
+        fs_msync(fs, home_off, MEMBLOCK_SZ_B);
     }
 
-    return num_blocks - blocks_used;
+    if (n) {
+        memset(head, 0, n * sizeof(uint32_t));
+        fs_msync(fs, fs->offset_journal, MEMBLOCK_SZ_B);
+        printf("Recovered metadata from %lu journal blocks\n", (lui)n);
+    }
 }
 
-// Populates buf with the given memblock's data and the data of any subsequent 
-// MemBlocks extending it. Returns: The size of the data at buf.
-// NOTE: buf must be pre-allocated - ex: malloc(inode->file_size_b)
-size_t memblock_data_get(FSHandle *fs, MemHead *memhead, const char *buf) {
-    MemHead *memblock = (MemHead*) memhead;
-    size_t total_sz = 0;
-    size_t old_sz = 0;
-    size_t sz_to_write = 0;
 
-    // Iterate each 'next' memblock until we get to one that pts no further
-    while (1) {
-        // Denote new required size of buf based on current pos in data
-        old_sz = total_sz;
-        sz_to_write = (size_t)memblock->data_size_b;
-        total_sz += sz_to_write;
+/* End Journal helpers ---------------------------------------------------- */
+/* Begin Memblock helpers ------------------------------------------------- */
+
 
-        if (!sz_to_write) 
-            break;  // memblock has zero bytes of data
+// Returns a ptr to the start of the memory block numbered blk.
+static void* memblock_ptr(FSHandle *fs, size_t blk) {
+    return ptr_from_offset(fs, blk * MEMBLOCK_SZ_B);
+}
 
-        // Get a ptr to memblock's data field
-        char *memblock_data_field = (char *)(memblock + ST_SZ_MEMHEAD);
+// Returns a ptr to the filesystem's free-space bitmap (1 bit per block, set
+// if the block is in use), scanned a 64-bit word at a time.
+static uint64_t* memblock_map(FSHandle *fs) {
+    return (uint64_t*)ptr_from_offset(fs, fs->offset_blkmap);
+}
 
-        // Cpy memblock's data into our buffer
-        void *buf_writeat = (char *)buf + old_sz;
-        memcpy(buf_writeat, memblock_data_field, sz_to_write);
-        
-        // If on the last (or only) memblock of the sequence, stop iterating
-        if (memblock->offset_nextblk == 0) 
-            break;
-        // Else, go to the next memblock in the sequence
+// Returns 1 if the given memory block is free, else returns 0.
+static int memblock_isfree(FSHandle *fs, size_t blk) {
+    if (memblock_map(fs)[blk / 64] & (UINT64_C(1) << (blk % 64)))
+        return 0;
+    return 1;
+}
+
+// Marks n memory blocks, starting at blk, as used (if used) or free, and
+// updates the free block count to match.
+// Assumes: Each of the blocks is currently in the opposite state.
+static void memblock_mark(FSHandle *fs, size_t blk, size_t n, int used) {
+    uint64_t *map = memblock_map(fs);
+
+    fs_journal(fs, fs, ST_SZ_FSHANDLE);
+    size_t blocks_free = used ? fs->blocks_free - n : fs->blocks_free + n;
+    __atomic_store_n(&fs->blocks_free, blocks_free, __ATOMIC_RELAXED);
+
+    while (n) {
+        size_t bit = blk % 64;
+        size_t cnt = (64 - bit < n) ? 64 - bit : n;
+        uint64_t mask = (cnt == 64) ? ~UINT64_C(0) 
+                                    : ((UINT64_C(1) << cnt) - 1) << bit;
+        fs_journal(fs, &map[blk / 64], sizeof(uint64_t));
+        if (used)
+            map[blk / 64] |= mask;
         else
-            memblock = (MemHead*)ptr_from_offset(fs, memblock->offset_nextblk);
+            map[blk / 64] &= ~mask;
+        fs_dirty(fs, &map[blk / 64], sizeof(uint64_t));
+        blk += cnt;
+        n -= cnt;
+    }
+    fs_dirty(fs, fs, ST_SZ_FSHANDLE);
+}
+
+// Returns the num of the first free memblock in [blk, end), or end if none.
+static size_t memblock_findfree(FSHandle *fs, size_t blk, size_t end) {
+    uint64_t *map = memblock_map(fs);
+
+    while (blk < end) {
+        uint64_t free_bits = ~map[blk / 64] >> (blk % 64);
+        if (free_bits) {
+            blk += __builtin_ctzll(free_bits);
+            return (blk < end) ? blk : end;
+        }
+        blk += 64 - (blk % 64);     // Whole rest of the word is in use
+    }
+    return end;
+}
+
+// Returns the num of consecutive free memblocks starting at blk, up to max.
+static size_t memblock_runlen(FSHandle *fs, size_t blk, size_t max) {
+    uint64_t *map = memblock_map(fs);
+    size_t len = 0;
+
+    if (max > fs->num_memblocks - blk)
+        max = fs->num_memblocks - blk;
+
+    while (len < max) {
+        uint64_t used_bits = map[blk / 64] >> (blk % 64);
+        size_t avail = 64 - (blk % 64);     // Bits left in this word
+        size_t run = used_bits ? (size_t)__builtin_ctzll(used_bits) : avail;
+        if (run > avail)
+            run = avail;
+        len += run;
+        if (run < avail)
+            break;                          // Hit a used block
+        blk += run;
+    }
+    return (len < max) ? len : max;
+}
+
+// Allocates a run of up to want contiguous free memblocks, trying goal first
+// (so growing files stay contiguous), then next-fit from the last allocation.
+// A run of the full length is preferred. If none is found within a bounded
+// number of candidates, the longest seen is used. If exact, only a run of the
+// full length will do. Sets *got to the run's length.
+// Returns: The num of the run's first block, or 0 if none could be found.
+// Note: Block 0 always holds the FSHandle, so 0 is never a valid data block.
+static size_t memblock_alloc(FSHandle *fs, size_t goal, size_t want, 
+                             int exact, size_t *got) {
+    size_t start = fs->first_datablk;       // Start of data blocks
+    size_t end = fs->num_memblocks;         // End of data blocks
+    size_t hint;                            // Where the last run ended
+    size_t best = 0, best_len = 0;          // Longest run seen so far
+    size_t blk, next, len;
+    int candidates = 64;                    // Max runs to consider
+
+    *got = 0;
+    pthread_mutex_lock(&alloc_lock);
+    hint = fs->alloc_hint;
+    if (hint < start || hint >= end)
+        hint = start;
+
+    // Try extending from the goal block
+    if (goal >= start && goal < end && memblock_isfree(fs, goal)) {
+        best = goal;
+        best_len = memblock_runlen(fs, goal, want);
+    }
+
+    // Else scan [hint, end), then wrap around to scan [start, hint)
+    for (int pass = 0; pass < 2; pass++) {
+        size_t to = pass ? hint : end;
+
+        blk = pass ? start : hint;
+        while (blk < to && best_len < want && candidates) {
+            if ((next = memblock_findfree(fs, blk, to)) == to)
+                break;                      // No more free blocks this pass
+
+            len = memblock_runlen(fs, next, want);
+            if (len > best_len) {
+                best = next;
+                best_len = len;
+            }
+            candidates--;
+            blk = next + len;
+        }
+    }
+
+    if (!best_len || (exact && best_len < want)) {
+        pthread_mutex_unlock(&alloc_lock);
+        return 0;                           // No suitable free blocks
+    }
+
+    memblock_mark(fs, best, best_len, 1);
+    fs->alloc_hint = best + best_len;
+    journal_marksafe(best, best_len);   // Not in use at the last checkpoint
+    pthread_mutex_unlock(&alloc_lock);
+    *got = best_len;
+    return best;
+}
+
+// Frees the run of n memory blocks starting at blk.
+// If the blocks held data the last checkpoint's state still needs (they were
+// in use then, and are not in the journal), they are only marked free at the
+// next checkpoint, so they cannot be overwritten before it.
+static void memblock_free(FSHandle *fs, size_t blk, size_t n) {
+    int safe = 1;
+
+    for (size_t i = 0; epoch_map && i < n && safe; i++)
+        safe = journal_issafe(blk + i);
+
+    pthread_mutex_lock(&alloc_lock);
+    if (!safe && frees_num == frees_cap) {
+        size_t cap = frees_cap ? frees_cap * 2 : 64;
+        BlockRun *grown = realloc(frees, cap * sizeof(BlockRun));
+        if (grown) {
+            frees = grown;
+            frees_cap = cap;
+        } else {
+            safe = 1;   // No memory to defer, so free now (not crash-safe)
+        }
+    }
+
+    if (safe) {
+        memblock_mark(fs, blk, n, 0);
+    } else {
+        frees[frees_num].blk = blk;
+        frees[frees_num].len = n;
+        frees_num++;
+        __atomic_store_n(&frees_blks, frees_blks + n, __ATOMIC_RELAXED);
     }
-    return total_sz;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Returns the number of free memblocks in the filesystem, counted from the
+// bitmap. Note: O(blocks / 64), use fs->blocks_free except when mounting.
+static size_t memblocks_numfree(FSHandle *fs) {
+    uint64_t *map = memblock_map(fs);
+    size_t map_words = (fs->num_memblocks + 63) / 64;
+    size_t blocks_used = 0;
+
+    // Note: Bits past the last block are set, so count over whole words
+    for (size_t i = 0; i < map_words; i++)
+        blocks_used += __builtin_popcountll(map[i]);
+
+    return map_words * 64 - blocks_used;
 }
 
 
 /* End Memblock helpers -------------------------------------------------- */
+/* Begin Name heap helpers ----------------------------------------------- */
+
+
+// Returns the size class of the slots that fit sz bytes.
+static size_t heap_class(size_t sz) {
+    size_t c = 0;
+    while ((size_t)(NAME_GRAIN << c) < sz)
+        c++;
+    return c;
+}
+
+// Returns the size class of the slots that fit a name of len chars.
+static size_t name_class(size_t len) {
+    return heap_class(len + 1);
+}
+
+// Returns a ptr to the name heap slot given by ref.
+static char* name_ptr(FSHandle *fs, uint32_t ref) {
+    return (char*)fs + (size_t)ref * NAME_GRAIN;
+}
+
+// Takes a free slot of size class c from the name heap, first carving a new
+// heap block into slots if the class has none free. The slot's contents are 
+// left as they were.
+// Returns: The slot's ref, or 0 if the fs is full.
+static uint32_t heap_alloc(FSHandle *fs, size_t c) {
+    size_t slot_sz = NAME_GRAIN << c;
+    uint32_t ref = 0;
+
+    pthread_mutex_lock(&heap_lock);
+    if (!fs->names_free[c]) {
+        size_t got = 0;
+        size_t blk = memblock_alloc(fs, 0, 1, 1, &got);
+        if (!blk) {
+            pthread_mutex_unlock(&heap_lock);
+            return 0;
+        }
+
+        // Chain the new block's slots, in order (it was not in use at the
+        // last checkpoint, so needs no journaling)
+        char *base = (char*)memblock_ptr(fs, blk);
+        uint32_t next = 0;
+        for (size_t off = MEMBLOCK_SZ_B; off >= slot_sz; off -= slot_sz) {
+            *(uint32_t*)(base + off - slot_sz) = next;
+            next = (uint32_t)(((size_t)(base - (char*)fs) + off - slot_sz) / 
+                              NAME_GRAIN);
+        }
+        fs_dirty(fs, base, MEMBLOCK_SZ_B);
+        fs_journal(fs, fs, ST_SZ_FSHANDLE);
+        fs->names_free[c] = next;
+    }
+
+    ref = fs->names_free[c];
+    fs_journal(fs, fs, ST_SZ_FSHANDLE);
+    fs->names_free[c] = *(uint32_t*)name_ptr(fs, ref);
+    fs_dirty(fs, fs, ST_SZ_FSHANDLE);
+    pthread_mutex_unlock(&heap_lock);
+    return ref;
+}
+
+// Returns the name heap slot given by ref, of size class c, to its class's 
+// free list.
+static void heap_free(FSHandle *fs, uint32_t ref, size_t c) {
+    char *slot = name_ptr(fs, ref);
+
+    pthread_mutex_lock(&heap_lock);
+    fs_journal(fs, fs, ST_SZ_FSHANDLE);
+    fs_journal(fs, slot, sizeof(uint32_t));
+    *(uint32_t*)slot = fs->names_free[c];
+    fs->names_free[c] = ref;
+    fs_dirty(fs, slot, sizeof(uint32_t));
+    fs_dirty(fs, fs, ST_SZ_FSHANDLE);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+// Stores a copy of the given name in a free slot of the name heap.
+// Returns: The slot's ref, or 0 if the fs is full.
+// Assumes: ns_lock is held exclusively. The name is under NAME_MAXLEN chars.
+static uint32_t name_alloc(FSHandle *fs, const char *name) {
+    size_t len = strlen(name);
+    size_t c = name_class(len);
+    uint32_t ref = heap_alloc(fs, c);
+
+    if (ref) {
+        char *slot = name_ptr(fs, ref);
+        fs_journal(fs, slot, NAME_GRAIN << c);
+        memcpy(slot, name, len + 1);
+        fs_dirty(fs, slot, len + 1);
+    }
+    return ref;
+}
+
+// Returns the name heap slot given by ref to its size class's free list.
+// Assumes: ns_lock is held exclusively.
+static void name_free(FSHandle *fs, uint32_t ref) {
+    heap_free(fs, ref, name_class(strlen(name_ptr(fs, ref))));
+}
+
+
+/* End Name heap helpers ------------------------------------------------- */
 /* Begin inode helpers --------------------------------------------------- */
 
 
+// Marks the given inode as changed since the last sync.
+static void inode_dirty(FSHandle *fs, Inode *inode) {
+    fs_dirty(fs, inode, ST_SZ_INODE);
+}
+
+// Journals the given inode's state at the last checkpoint, if not yet done.
+// Call before any change to the inode other than to its times.
+static void inode_journal(FSHandle *fs, Inode *inode) {
+    fs_journal(fs, inode, ST_SZ_INODE);
+}
+
+// Returns a ptr to the given inline file's data.
+static char* inode_inline_ptr(FSHandle *fs, Inode *inode) {
+    if (inode->is_inline == INLINE_HEAP)
+        return name_ptr(fs, inode->heap_ref);
+    return inode->inline_data;
+}
+
+// Returns the num of bytes of data the given inline file has room for.
+static size_t inode_inline_cap(Inode *inode) {
+    if (inode->is_inline == INLINE_HEAP)
+        return (size_t)NAME_GRAIN << inode->heap_class;
+    return INODE_INLINE_MAX;
+}
+
+// Journals the given inline file's data before it is changed in place.
+static void inode_inline_journal(FSHandle *fs, Inode *inode) {
+    if (inode->is_inline == INLINE_HEAP)
+        fs_journal(fs, name_ptr(fs, inode->heap_ref), inode_inline_cap(inode));
+    else
+        inode_journal(fs, inode);       // Shares the inode's block
+}
+
+// Returns the given time as ns since the epoch.
+static int64_t time_to_ns(const struct timespec *ts) {
+    return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+// Returns the given ns since the epoch as a timespec.
+static struct timespec time_from_ns(int64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    if (ts.tv_nsec < 0) {
+        ts.tv_sec--;
+        ts.tv_nsec += 1000000000;
+    }
+    return ts;
+}
+
 // Sets the last access time for the given node to the current time.
 // If set_modified, also sets the last modified time to the current time.
-static void inode_lasttimes_set(Inode *inode, int set_modified) {
+// Any other changes made to the inode are marked for sync along with these.
+static void inode_lasttimes_set(FSHandle *fs, Inode *inode, int set_modified) {
     if (!inode) return;
 
     struct timespec tspec;
     clock_gettime(CLOCK_REALTIME, &tspec);
+    int64_t now = time_to_ns(&tspec);
 
-    inode->last_acc = &tspec;
+    // Readers sharing the inode's lock all stamp its access time, so store it
+    // atomically
+    __atomic_store_n(&inode->last_acc, now, __ATOMIC_RELAXED);
     if (set_modified)
-        inode->last_mod = &tspec;
+        inode->last_mod = now;
+    inode_dirty(fs, inode);
 }
 
 // Returns 1 if the given inode is for a directory, else 0
@@ -288,7 +1016,7 @@ static int inode_name_isvalid(char *name) {
 
     for (char *c = name; *c != '\0'; c++) {
         len++;
-        if (len > NAME_MAXLEN) return 0;            // Check for over max length
+        if (len >= NAME_MAXLEN) return 0;           // Check for over max length
         if (!inode_name_charvalid(*c)) return 0;    // Check for illegal chars
     }
 
@@ -296,354 +1024,1676 @@ static int inode_name_isvalid(char *name) {
     return 1;            // Valid
 }
 
-// Sets the file or directory name (of length sz) for the given inode.
-// Returns: 1 on success, else 0 for invalid filename)
-int inode_name_set(Inode *inode, char *name) {
-    if (!inode_name_isvalid(name))
-        return 0;
-    strcpy(inode->name, name); 
-    return 1;
+// Returns the given inode's file or directory name.
+static const char* inode_name(FSHandle *fs, Inode *inode) {
+    return inode->name ? name_ptr(fs, inode->name) : FS_PATH_SEP;
 }
 
-// Returns a ptr to the given inode's first memory block, or NULL if none.
-static MemHead* inode_firstmemblock(FSHandle *fs, Inode *inode) {
-    return (MemHead*)ptr_from_offset(fs, inode->offset_firstblk);
+// Sets the file or directory name for the given inode, replacing any old one.
+// Returns: 1 on success, else 0 (invalid filename, or the fs is full).
+// Assumes: ns_lock is held exclusively.
+static int inode_name_set(FSHandle *fs, Inode *inode, char *name) {
+    uint32_t ref;
+
+    if (!inode_name_isvalid(name) || !(ref = name_alloc(fs, name)))
+        return 0;
+
+    inode_journal(fs, inode);
+    if (inode->name)
+        name_free(fs, inode->name);
+    inode->name = ref;
+    inode_dirty(fs, inode);
+    return 1;
 }
 
 // Returns 1 if the given inode is free, else returns 0.
 static int inode_isfree(Inode *inode) {
-    if (inode->offset_firstblk == 0)
+    if (inode->not_free == 0)
         return 1;
     return 0;
 }
 
-// Returns the first free inode in the given filesystem
-static Inode* inode_nextfree(FSHandle *fs) {
-    Inode *inode = fs->inode_seg;
-
-    for (int i = 0; i < fs->num_inodes; i++) {
-        if (inode_isfree(inode))
-            return inode;
-        inode++;
-    }
-
-    return NULL;
+// Returns a ptr to the inode map.
+static uint32_t* inode_map(FSHandle *fs) {
+    return (uint32_t*)memblock_ptr(fs, fs->imap_blk);
 }
 
+// Returns a ptr to the inode numbered num. The root dir is inode 0.
+static Inode* inode_get(FSHandle *fs, size_t num) {
+    size_t blk = inode_map(fs)[num / INODES_PER_BLK];
+    InodeBlock *iblk = (InodeBlock*)memblock_ptr(fs, blk);
+    return &iblk->inodes[num % INODES_PER_BLK];
+}
 
-/* End inode helpers ----------------------------------------------------- */
-/* Begin String Helpers -------------------------------------------------- */
+// Returns the given inode's num.
+static size_t inode_num(FSHandle *fs, Inode *inode) {
+    size_t off = (char*)inode - (char*)fs;
+    InodeBlock *iblk = (InodeBlock*)((char*)fs + off - off % MEMBLOCK_SZ_B);
+    return iblk->group * INODES_PER_BLK + (inode - iblk->inodes);
+}
 
+// Takes the given inode's lock, exclusively if excl (to change its data or
+// attributes). Inodes share INODE_LOCKS locks, striped by inode num.
+// Assumes: The namespace lock is held, so the inode stays in use.
+static void inode_lock(FSHandle *fs, Inode *inode, int excl) {
+    pthread_rwlock_t *lock = &inode_locks[inode_num(fs, inode) % INODE_LOCKS];
 
-// Returns the length  of the given null-terminated char array
-size_t str_len(char *arr) {
-    int length = 0;
-    for (char *c = arr; *c != '\0'; c++)
-        length++;
+    if (excl)
+        pthread_rwlock_wrlock(lock);
+    else
+        pthread_rwlock_rdlock(lock);
+}
 
-    return length;
+// Releases the given inode's lock.
+static void inode_unlock(FSHandle *fs, Inode *inode) {
+    pthread_rwlock_unlock(&inode_locks[inode_num(fs, inode) % INODE_LOCKS]);
 }
 
-// Returns an index to the name element of the given path. Additionaly, sets
-// pathlen to the size in bytes of the path. Ex: path ='/dir1/file1' returns 6
-static size_t str_name_offset(const char *path, size_t *pathlen) {
-    char *start, *token, *next, *name;
+// Carves the given newly allocated memory block into the next inode group,
+// entering it in the inode map and linking its inodes into the free inodes 
+// list (but for inode 0, the root dir).
+// Assumes: ns_lock is held exclusively, and the inode map has room.
+static void inode_group_init(FSHandle *fs, size_t blk) {
+    size_t group = fs->num_inodes / INODES_PER_BLK;
+    size_t first = group ? group * INODES_PER_BLK : 1;
+    size_t end = (group + 1) * INODES_PER_BLK;
+    InodeBlock *iblk = (InodeBlock*)memblock_ptr(fs, blk);
+    uint32_t *imap = inode_map(fs);
+
+    // The block was not in use at the last checkpoint, so needs no journaling
+    memset(iblk, 0, MEMBLOCK_SZ_B);
+    iblk->group = (uint32_t)group;
+    fs_dirty(fs, iblk, MEMBLOCK_SZ_B);
+
+    fs_journal(fs, &imap[group], sizeof(uint32_t));
+    imap[group] = (uint32_t)blk;
+    fs_dirty(fs, &imap[group], sizeof(uint32_t));
+
+    pthread_mutex_lock(&alloc_lock);
+    fs_journal(fs, fs, ST_SZ_FSHANDLE);
+    for (size_t i = first; i < end; i++)
+        iblk->inodes[i % INODES_PER_BLK].next_free = 
+            (i + 1 < end) ? (uint32_t)(i + 1) : fs->inodes_next;
+    fs->inodes_next = (uint32_t)first;
+    fs->inodes_free += end - first;
+    fs->num_inodes = end;
+    fs_dirty(fs, fs, ST_SZ_FSHANDLE);
+    pthread_mutex_unlock(&alloc_lock);
+}
 
-    start = next = strdup(path);    // Duplicate path so we can manipulate it
-    *pathlen = str_len(next);       // Set pathlen for caller
-    next++;                         // Skip initial seperator
-    
-    while ((token = strsep(&next, FS_PATH_SEP)))
-        if (!next)
-            name = token;
+// Adds an inode group to the filesystem, first moving the inode map to a 
+// doubled run if it is full.
+// Returns: 1 on success, else 0 (the fs is full).
+// Assumes: ns_lock is held exclusively, so no inode lookups are under way.
+static int inode_group_add(FSHandle *fs) {
+    size_t groups = fs->num_inodes / INODES_PER_BLK;
+    size_t got = 0;
+    size_t blk;
+
+    if (groups == fs->imap_blks * IMAP_PER_BLK) {
+        size_t new_n = fs->imap_blks * 2;
+        size_t new_blk = memblock_alloc(fs, 0, new_n, 1, &got);
+        if (!new_blk)
+            return 0;
+
+        void *new_map = memblock_ptr(fs, new_blk);
+        memcpy(new_map, inode_map(fs), fs->imap_blks * MEMBLOCK_SZ_B);
+        fs_dirty(fs, new_map, fs->imap_blks * MEMBLOCK_SZ_B);
+        memblock_free(fs, fs->imap_blk, fs->imap_blks);
+
+        pthread_mutex_lock(&alloc_lock);
+        fs_journal(fs, fs, ST_SZ_FSHANDLE);
+        fs->imap_blk = new_blk;
+        fs->imap_blks = new_n;
+        fs_dirty(fs, fs, ST_SZ_FSHANDLE);
+        pthread_mutex_unlock(&alloc_lock);
+    }
 
-    size_t index = name - start; 
-    free(start);
+    if (!(blk = memblock_alloc(fs, 0, 1, 1, &got)))
+        return 0;
+    inode_group_init(fs, blk);
+    return 1;
+}
 
-    return index;
+// Returns the free inode at the head of the free inodes list
+static Inode* inode_nextfree(FSHandle *fs) {
+    if (!fs->inodes_next)
+        return NULL;
+    return inode_get(fs, fs->inodes_next);
 }
 
-// Returns number of digits necessary to represent the given num as a string
-static size_t digits_count(size_t num) {
-    int num_digits = 0;
+// Claims the free inode at the head of the free inodes list for use, adding
+// an inode group first if the list is empty.
+// Returns: A ptr to the inode, or NULL if none are free.
+// Assumes: ns_lock is held exclusively (so only this thread takes from the
+// list), and alloc_lock is not held.
+static Inode* inode_alloc(FSHandle *fs) {
+    if (!fs->inodes_next && !inode_group_add(fs))
+        return NULL;
+
+    pthread_mutex_lock(&alloc_lock);
+    Inode *inode = inode_nextfree(fs);
 
-    while(num != 0) {
-        num_digits++;
-        num /= 10;
+    if (inode) {
+        inode_journal(fs, inode);
+        fs_journal(fs, fs, ST_SZ_FSHANDLE);
+        fs->inodes_next = inode->next_free;
+        inode->name = 0;
+        inode->not_free = 1;
+        fs->inodes_free--;
+        inode_dirty(fs, inode);
+        fs_dirty(fs, fs, ST_SZ_FSHANDLE);
     }
+    pthread_mutex_unlock(&alloc_lock);
+    return inode;
+}
 
-    return num_digits;
+// Releases the given inode for reuse, pushing it onto the free inodes list.
+// Assumes: The inode's data has already been removed.
+static void inode_free(FSHandle *fs, Inode *inode) {
+    inode_journal(fs, inode);
+    if (inode->name)
+        name_free(fs, inode->name);
+    inode->is_dir = 0;
+    inode->subdirs = 0;
+    pthread_mutex_lock(&alloc_lock);
+    fs_journal(fs, fs, ST_SZ_FSHANDLE);
+    inode->not_free = 0;
+    inode->next_free = fs->inodes_next;
+    fs->inodes_next = (uint32_t)inode_num(fs, inode);
+    fs->inodes_free++;
+    inode_dirty(fs, inode);
+    fs_dirty(fs, fs, ST_SZ_FSHANDLE);
+    pthread_mutex_unlock(&alloc_lock);
 }
 
+// Returns the number of free inodes in the filesystem, counted from the
+// inode groups. Note: O(inodes), use fs->inodes_free except when mounting.
+static size_t inodes_numfree(FSHandle *fs) {
+    uint32_t *imap = inode_map(fs);
+    size_t inodes_free = 0;
+
+    for (size_t g = 0; g < fs->num_inodes / INODES_PER_BLK; g++) {
+        InodeBlock *iblk = (InodeBlock*)memblock_ptr(fs, imap[g]);
+        for (size_t i = 0; i < INODES_PER_BLK; i++)
+            if (inode_isfree(&iblk->inodes[i]))
+                inodes_free++;
+    }
 
-/* End String Helpers ---------------------------------------------------- */
-/* Begin filesystem helpers ---------------------------------------------- */
+    return inodes_free;
+}
 
+// Returns a ptr to the given inode's extent map (inline or indirect).
+static Extent* inode_extents(FSHandle *fs, Inode *inode) {
+    if (inode->is_indirect)
+        return (Extent*)memblock_ptr(fs, inode->extblk);
+    return inode->extents;
+}
 
-// Returns the root directory's inode for the given file system.
-static Inode* fs_rootnode_get(FSHandle *fs) {
-    return fs->inode_seg;
+// Returns the num of extents the given inode's extent map can hold.
+static size_t inode_extents_cap(Inode *inode) {
+    if (inode->is_indirect)
+        return inode->extblk_n * EXTENTS_PER_BLOCK;
+    return INODE_EXTENTS;
 }
 
-// Returns a handle to a filesystem of size fssize onto fsptr.
-// If the fsptr not yet intitialized as a file system, it is formatted first.
-static FSHandle* fs_init(void *fsptr, size_t size) {
-    // Validate file system size
-    if (size < MIN_FS_SZ_B) {
-        printf("ERROR: File system size too small.\n");
-        return NULL;
-    }
+// Returns the num of logical blocks up to the end of the given inode's last
+// extent (holes included).
+static size_t inode_numblocks(FSHandle *fs, Inode *inode) {
+    if (!inode->num_extents)
+        return 0;
+    Extent *last = inode_extents(fs, inode) + inode->num_extents - 1;
+    return last->lblk + last->len;
+}
 
-    // Map file system structure onto the given memory space
-    FSHandle *fs = (FSHandle*)fsptr;
+// Returns the num of memory blocks in use by the given inode's data and
+// indirect extent map. O(extents).
+static size_t inode_blocks_used(FSHandle *fs, Inode *inode) {
+    if (inode->is_inline)
+        return 0;
 
-    size_t fs_size = size - FS_START_OFFSET;    // Space available to fs
-    void *segs_start = fsptr + FS_START_OFFSET; // Start of fs's segments
-    void *memblocks_seg = NULL;                 // Mem block segment start addr
-    int n_inodes = 0;                           // Num inodes fs contains
-    int n_blocks = 0;                           // Num memblocks fs contains
+    Extent *ext = inode_extents(fs, inode);
+    size_t used = inode->is_indirect ? inode->extblk_n : 0;
 
-    // Determine num inodes & memblocks that will fit in the given size
-    while (n_blocks * DATAFIELD_SZ_B + n_inodes * ST_SZ_INODE < fs_size) {
-        n_inodes++;
-        n_blocks += BLOCKS_TO_INODES;
-    }
-    
-    // Denote memblocks addr & offset
-    memblocks_seg = segs_start + (ST_SZ_INODE * n_inodes);
-    
-    // If first bytes aren't our magic number, format the mem space for the fs
-    if (fs->magic != MAGIC_NUM) {
-        // Format mem space w/zero-fill
-        memset(fsptr, 0, fs_size);
-        
-        // Populate fs data members
-        fs->magic = MAGIC_NUM;
-        fs->size_b = fs_size;
-        fs->num_inodes = n_inodes;
-        fs->num_memblocks = n_blocks;
-        fs->inode_seg = (Inode*) segs_start;
-        fs->mem_seg = (MemHead*) memblocks_seg;
-
-        // Set up 0th inode as the root directory having path FS_PATH_SEP
-        Inode *root_inode = fs_rootnode_get(fs);
-        strncpy(root_inode->name, FS_PATH_SEP, str_len(FS_PATH_SEP));
-        *(int*)(&root_inode->is_dir) = 1;
-        *(int*)(&root_inode->subdirs) = 0;
-        fs->inode_seg->offset_firstblk = (size_t*) (memblocks_seg - fsptr);
-        *(int*)(&fs->mem_seg->not_free) = 1;
-        inode_lasttimes_set(root_inode, 1);
-    } 
+    for (size_t i = 0; i < inode->num_extents; i++)
+        used += ext[i].len;
+    return used;
+}
 
-    // Otherwise, file system already intitialized, just populate the handle
-    else {
-        fs->size_b = fs_size;
-        fs->num_inodes = n_inodes;
-        fs->num_memblocks = n_blocks;
-        fs->inode_seg = (Inode*) segs_start;
-        fs->mem_seg = (MemHead*) memblocks_seg;
+// Returns the index of the first extent of the given inode ending after
+// logical block lblk (the one holding lblk, or else the first one after the
+// hole holding it), or num_extents if none. Binary search, O(log extents).
+static size_t inode_extent_next(FSHandle *fs, Inode *inode, size_t lblk) {
+    Extent *ext = inode_extents(fs, inode);
+    size_t lo = 0;
+    size_t hi = inode->num_extents;     // Search [lo, hi) for first end > lblk
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((size_t)ext[mid].lblk + ext[mid].len <= lblk)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-
-    return fs;  // Return handle to the file system
+    return lo;
 }
 
+// Returns the index of the extent of the given inode holding logical block
+// lblk, or -1 if lblk is not mapped (a hole). O(log extents).
+static long inode_extent_find(FSHandle *fs, Inode *inode, size_t lblk) {
+    size_t idx = inode_extent_next(fs, inode, lblk);
 
-// Returns a handle to a myfs filesystem on success.
-// On fail, sets errnoptr to EFAULT and returns NULL.
-static FSHandle *fs_handle(void *fsptr, size_t fssize, int *errnoptr) {
-    FSHandle *fs = fs_init(fsptr, fssize);
-    if (!fs && errnoptr) *errnoptr = EFAULT;
-    return fs;
+    if (idx == inode->num_extents || inode_extents(fs, inode)[idx].lblk > lblk)
+        return -1;  // Not mapped
+    return idx;
 }
 
-// A debug function to simulate a resolve_path() call. 
-// Returns some hardcoded test inode (ex: the root dir).
-// On fail, sets errnoptr to ENOENT and returns NULL.
-// Assumes: path is absolute.
-static Inode *fs_pathresolve(FSHandle *fs, const char *path, int *errnoptr) {
-    // Ensure at least root dir symbol present
-    if (strncmp(path, FS_PATH_SEP, 1) != 0) {
-        *errnoptr = EINVAL;
-        return NULL;                
+// Puts the runs of holes among the given inode's logical blocks [first, last)
+// into runs, in order, as (first block, num blocks).
+// Returns: The num of runs, at most (last - first + 1) / 2.
+static size_t inode_holes_find(FSHandle *fs, Inode *inode, size_t first,
+                               size_t last, BlockRun *runs) {
+    Extent *ext = inode_extents(fs, inode);
+    size_t idx = inode_extent_next(fs, inode, first);
+    size_t lblk = first, n = 0;
+
+    while (lblk < last) {
+        size_t next = (idx < inode->num_extents && ext[idx].lblk < last) 
+                    ? ext[idx].lblk : last;
+        if (next > lblk) {
+            runs[n].blk = lblk;
+            runs[n].len = next - lblk;
+            n++;
+        }
+        if (idx == inode->num_extents)
+            break;
+        lblk = (size_t)ext[idx].lblk + ext[idx].len;
+        idx++;
     }
-
-    Inode *inode = resolve_path(fs, path);
-    if (!inode && errnoptr) *errnoptr = ENOENT;
-    return inode;
+    return n;
 }
 
+// Moves the given inode's extent map to an indirect run twice the size of
+// its current storage, so that more extents can be added.
+// Returns: 1 on success, else 0 (no contiguous run available).
+static int inode_extents_grow(FSHandle *fs, Inode *inode) {
+    size_t new_n = inode->is_indirect ? inode->extblk_n * 2 : 1;
+    size_t got = 0;
+    size_t new_blk = memblock_alloc(fs, 0, new_n, 1, &got);
 
-/* End Filesystem Helpers ------------------------------------------------- */
-/* Begin Inode helpers ---------------------------------------------------- */
-
+    if (!new_blk)
+        return 0;
 
-// Populates buf with a string representing the given inode's data.
-// Returns: The size of the data at buf.
-// NOTE: buf should be pre-sized with malloc(inode->file_size_b)
-static size_t inode_data_get(FSHandle *fs, Inode *inode, const char *buf) {
-    inode_lasttimes_set(inode, 0);
-    return memblock_data_get(fs, inode_firstmemblock(fs, inode), buf);   
+    memcpy(memblock_ptr(fs, new_blk), inode_extents(fs, inode),
+           inode->num_extents * ST_SZ_EXTENT);
+    fs_dirty(fs, memblock_ptr(fs, new_blk), inode->num_extents * ST_SZ_EXTENT);
+
+    inode_journal(fs, inode);
+    if (inode->is_indirect)
+        memblock_free(fs, inode->extblk, inode->extblk_n);
+    inode->is_indirect = 1;
+    inode->extblk = new_blk;
+    inode->extblk_n = new_n;
+    inode_dirty(fs, inode);
+    return 1;
 }
 
-// Disassociates any data from inode, formats any previously used memblocks,
-// and, if newblock, assign the inode a new free first memblock.
-static void inode_data_remove(FSHandle *fs, Inode *inode, int newblock) {
-    MemHead *memblock = inode_firstmemblock(fs, inode);
-    MemHead *block_next;     // ptr to memblock->offset_nextblk
-    void *block_end;         // End of memblock's data field
-
-     // Format each memblock used by inode (implicitly sets size& not_free)
-    do {
-        block_next = (MemHead*)ptr_from_offset(fs, memblock->offset_nextblk);
-        block_end = (void*)memblock + MEMBLOCK_SZ_B;         // End of memblock
-        memset(memblock, 0, (block_end - (void*)memblock));  // Format memblock
-        memblock = (MemHead*)block_next;                     // Advance to next
-        
-    } while (block_next != (MemHead*)fs);                    // i.e. nextblk != 0
+// Maps the len physical blocks starting at pblk as the given inode's logical
+// blocks from lblk, which must lie in the hole before extent idx (or after the
+// last extent, if idx is num_extents). Extends the previous extent instead
+// when both logically and physically contiguous with it.
+// Returns: 1 on success, else 0 (no room to grow the extent map).
+static int inode_extent_insert(FSHandle *fs, Inode *inode, size_t idx,
+                               size_t lblk, size_t pblk, size_t len) {
+    Extent *ext = inode_extents(fs, inode);
+
+    // Extend the previous run if contiguous
+    if (idx) {
+        Extent *prev = ext + idx - 1;
+        if (prev->lblk + prev->len == lblk && prev->pblk + prev->len == pblk) {
+            fs_journal(fs, prev, ST_SZ_EXTENT);
+            prev->len += len;
+            fs_dirty(fs, prev, ST_SZ_EXTENT);
+            return 1;
+        }
+    }
 
-    // Update the inode to reflect the disassociation
-    *(int*)(&inode->file_size_b) = 0;
-    inode_lasttimes_set(inode, 1);
+    // Else start a new run, moving to a bigger map if the current one is full
+    if (inode->num_extents == inode_extents_cap(inode)) {
+        if (!inode_extents_grow(fs, inode))
+            return 0;
+        ext = inode_extents(fs, inode);
+    }
 
-    // Associate w/ new memblock, if specified
-    if (newblock)
-        inode->offset_firstblk = 
-            (size_t*)offset_from_ptr(fs, memblock_nextfree(fs));
+    // Shift the later runs up one to make room
+    size_t n_after = inode->num_extents - idx;
+
+    inode_journal(fs, inode);
+    fs_journal(fs, &ext[idx], (n_after + 1) * ST_SZ_EXTENT);
+    memmove(&ext[idx + 1], &ext[idx], n_after * ST_SZ_EXTENT);
+    ext[idx].lblk = lblk;
+    ext[idx].pblk = pblk;
+    ext[idx].len = len;
+    fs_dirty(fs, &ext[idx], (n_after + 1) * ST_SZ_EXTENT);
+    inode->num_extents++;
+    inode_dirty(fs, inode);
+    return 1;
 }
 
-// Sets data field and updates size fields for the file or dir denoted by
-// inode including handling of the  linked list of memory blocks for the data.
-// Assumes: Filesystem has enough free memblocks to accomodate data.
-// Assumes: inode has its offset_firstblk set.
-static void inode_data_set(FSHandle *fs, Inode *inode, char *data, size_t sz) {
-    // If inode has existing data or no memblock associated.
-    if (inode->file_size_b || inode->offset_firstblk == 0)
-        inode_data_remove(fs, inode, 1);
-
-    MemHead *memblock = inode_firstmemblock(fs, inode);
-
-    // Use a single block if sz will fit in one
-    if (sz <= DATAFIELD_SZ_B) {
-        void *data_field = memblock + ST_SZ_MEMHEAD;
-        memcpy(data_field, data, sz);
-        *(int*)(&memblock->not_free) = 1;
-        memblock->data_size_b = (size_t*) sz;
-        memblock->offset_nextblk = 0;
-    }
-
-    // Else use multiple blocks, if available
-    else {
-        // Determine num blocks needed
-        size_t num_bytes = sz;
-        
-        // Populate the memory blocks with the data
-        char *data_idx = data;
-        MemHead *prev_block = NULL;
-        size_t write_bytes = 0;
-        
-        while (num_bytes) {
-            // Determine num bytes to write this iteration
-            if (num_bytes > DATAFIELD_SZ_B)
-                write_bytes = DATAFIELD_SZ_B;           // More blocks yet needed
-            else
-                write_bytes = num_bytes;                // Last block needed
-
-            // Write the bytes to the data field
-            char *ptr_writeto = memblock_datafield(fs, memblock);
-            memcpy(ptr_writeto, data_idx, write_bytes);
-            *(int*)(&memblock->not_free) = 1;
-            *(size_t*)(&memblock->data_size_b) = write_bytes;
-
-            // Update next block offsets as needed
-            if (prev_block) 
-                prev_block->offset_nextblk = 
-                    (size_t*)offset_from_ptr(fs, (void*)memblock);
-            prev_block = memblock;
-            memblock->offset_nextblk = 0;
-        
-            // Set up the next iteration
-            data_idx += write_bytes;
-            num_bytes = num_bytes - write_bytes; // Adjust num bytes to write
-            memblock = memblock_nextfree(fs);    // Adavance to next free block
+// Unmaps and frees the given inode's logical block lblk, leaving it a hole.
+// Splits the run holding it if lblk is in its middle.
+// Returns: 1 on success, else 0 (not mapped, or no room to split the run).
+static int inode_block_unmap(FSHandle *fs, Inode *inode, size_t lblk) {
+    long idx = inode_extent_find(fs, inode, lblk);
+
+    if (idx < 0)
+        return 0;
+
+    Extent *ext = inode_extents(fs, inode);
+    Extent run = ext[idx];
+    size_t off = lblk - run.lblk;
+
+    if (off && off + 1 < run.len) {
+        // The part after lblk becomes a run of its own
+        if (!inode_extent_insert(fs, inode, idx + 1, lblk + 1, 
+                                 run.pblk + off + 1, run.len - off - 1))
+            return 0;
+        ext = inode_extents(fs, inode);
+        fs_journal(fs, &ext[idx], ST_SZ_EXTENT);
+        ext[idx].len = off;
+        fs_dirty(fs, &ext[idx], ST_SZ_EXTENT);
+    } else if (run.len == 1) {
+        // The whole run goes, shift the later runs down one
+        size_t n_after = inode->num_extents - idx - 1;
+
+        inode_journal(fs, inode);
+        fs_journal(fs, &ext[idx], (n_after + 1) * ST_SZ_EXTENT);
+        memmove(&ext[idx], &ext[idx + 1], n_after * ST_SZ_EXTENT);
+        fs_dirty(fs, &ext[idx], n_after * ST_SZ_EXTENT);
+        inode->num_extents--;
+        inode_dirty(fs, inode);
+    } else {
+        // The run is cut short at its start or end
+        fs_journal(fs, &ext[idx], ST_SZ_EXTENT);
+        if (!off) {
+            ext[idx].lblk++;
+            ext[idx].pblk++;
         }
+        ext[idx].len--;
+        fs_dirty(fs, &ext[idx], ST_SZ_EXTENT);
     }
 
-    // Update access/mod times and file size
-    inode_lasttimes_set(inode, 1);
-    inode->file_size_b = (size_t*) sz;
+    memblock_free(fs, run.pblk + off, 1);
+    return 1;
 }
 
-// Appends the given data to the given Inode's current data. For appending
-// a file/dir "label:offset\n" line to the directory, for example.
-// No validation is performed on append_data. Assumes: append_data is a string.
-static void inode_data_append(FSHandle *fs, Inode *inode, char *append_data) {
-    // Get parent dir's lookup table
-    size_t data_sz = 0;
-    size_t append_sz = str_len(append_data);
-    char *data = malloc(*(int*)(&inode->file_size_b) + append_sz);
-    data_sz = inode_data_get(fs, inode, data);
-    size_t total_sz = data_sz + append_sz;
-
-    // Concat append data
-    memcpy(data + data_sz, append_data, append_sz);
-    inode_data_set(fs, inode, data, total_sz);
-    free(data);
+// Returns 1 if the MEMBLOCK_SZ_B bytes at p are all zeros, else 0.
+static int block_iszero(const char *p) {
+    return !p[0] && !memcmp(p, p + 1, MEMBLOCK_SZ_B - 1);
 }
 
+// Returns 1 if a write of size bytes from buf at offset covers all of logical
+// block lblk with zeros, else 0 (also if buf is NULL).
+static int write_iszeroblock(const char *buf, size_t size, size_t offset,
+                             size_t lblk) {
+    size_t start = lblk * MEMBLOCK_SZ_B;
 
-/* End Inode helpers ------------------------------------------------------ */
-/* Begin Directory helpers ------------------------------------------------ */
+    if (!buf || start < offset || start + MEMBLOCK_SZ_B > offset + size)
+        return 0;
+    return block_iszero(buf + (start - offset));
+}
 
+// Maps new blocks for the holes among the given inode's logical blocks 
+// [first, end), as few contiguous runs as possible, each starting right after
+// the preceding mapped block if free. Blocks that the write of size bytes from
+// buf at offset covers with zeros are left as holes.
+// Returns: The first block left unmapped for lack of space, else end.
+static size_t inode_blocks_map(FSHandle *fs, Inode *inode, size_t first,
+                               size_t end, const char *buf, size_t size, 
+                               size_t offset) {
+    size_t lblk = first;
+
+    while (lblk < end) {
+        Extent *ext = inode_extents(fs, inode);
+        size_t idx = inode_extent_next(fs, inode, lblk);
+
+        // Skip over mapped runs and blocks of zeros
+        if (idx < inode->num_extents && ext[idx].lblk <= lblk) {
+            lblk = ext[idx].lblk + ext[idx].len;
+            continue;
+        }
+        if (write_iszeroblock(buf, size, offset, lblk)) {
+            lblk++;
+            continue;
+        }
 
-// Returns the inode for the given item (a sub-directory or file) having the
-// parent directory given by inode (Or NULL if item could not be found).
-static Inode* dir_subitem_get(FSHandle *fs, Inode *inode, char *name) {
-    // Get parent dir's data
-    char *curr_data = malloc(*(int*)(&inode->file_size_b));
-    inode_data_get(fs, inode, curr_data);
+        // Map up to the end of the hole, or the next block of zeros
+        size_t hole_end = (idx < inode->num_extents && ext[idx].lblk < end) 
+                        ? ext[idx].lblk : end;
+        size_t run_end = lblk + 1;
+        while (run_end < hole_end && 
+               !write_iszeroblock(buf, size, offset, run_end))
+            run_end++;
+
+        size_t goal = idx ? ext[idx - 1].pblk + ext[idx - 1].len : 0;
+        size_t got = 0;
+        size_t blk = memblock_alloc(fs, goal, run_end - lblk, 0, &got);
+
+        if (!blk)
+            return lblk;                        // Out of free memblocks
+        if (!inode_extent_insert(fs, inode, idx, lblk, blk, got)) {
+            memblock_free(fs, blk, got);        // No room in extent map
+            return lblk;
+        }
+        lblk += got;
+    }
+    return end;
+}
 
-    // Get ptr to the items line in the parent dir's file/dir data.
-    char *subdir_ptr = strstr(curr_data, name);
+// Unmaps and frees the given inode's logical blocks from nblks on, walking
+// back from its last run. Moves the extent map back inline if it now fits.
+// O(runs freed).
+static void inode_blocks_shrink(FSHandle *fs, Inode *inode, size_t nblks) {
+    Extent *ext = inode_extents(fs, inode);
+
+    inode_journal(fs, inode);
+    while (inode->num_extents) {
+        Extent *last = ext + inode->num_extents - 1;
+
+        if (last->lblk >= nblks) {
+            memblock_free(fs, last->pblk, last->len);   // Whole run goes
+            inode->num_extents--;
+            continue;
+        }
+        if (last->lblk + last->len > nblks) {
+            size_t keep = nblks - last->lblk;           // Run is cut short
+            fs_journal(fs, last, ST_SZ_EXTENT);
+            memblock_free(fs, last->pblk + keep, last->len - keep);
+            last->len = keep;
+            fs_dirty(fs, last, ST_SZ_EXTENT);
+        }
+        break;
+    }
+
+    if (inode->is_indirect && inode->num_extents <= INODE_EXTENTS) {
+        size_t extblk = inode->extblk;
+        size_t extblk_n = inode->extblk_n;
+        memcpy(inode->extents, ext, inode->num_extents * ST_SZ_EXTENT);
+        memblock_free(fs, extblk, extblk_n);
+        inode->is_indirect = 0;
+    }
+    inode_dirty(fs, inode);
+}
+
+// Copies (if to_buf) the given inode's bytes [offset, offset + size) into buf,
+// or (else) buf into them, one memcpy per contiguous run. Holes read as zeros
+// and are skipped when writing. A NULL buf when writing writes zeros.
+// Assumes: If the inode is inline, the range lies within its inline room.
+static void inode_data_xfer(FSHandle *fs, Inode *inode, char *buf, size_t size,
+                            size_t offset, int to_buf) {
+    if (inode->is_inline) {
+        char *data = inode_inline_ptr(fs, inode) + offset;
+        if (!to_buf)
+            inode_inline_journal(fs, inode);
+        if (to_buf)
+            memcpy(buf, data, size);
+        else if (buf)
+            memcpy(data, buf, size);
+        else
+            memset(data, 0, size);
+        if (!to_buf)
+            fs_dirty(fs, data, size);
+        return;
+    }
 
-    // If subdir does not exist, return NULL
-    if(subdir_ptr == NULL) {
-        free(curr_data);
+    Extent *ext = inode_extents(fs, inode);
+    size_t idx = inode_extent_next(fs, inode, offset / MEMBLOCK_SZ_B);
+
+    while (size) {
+        size_t cpy_sz;
+
+        if (idx == inode->num_extents || 
+            offset < (size_t)ext[idx].lblk * MEMBLOCK_SZ_B) {
+            // In a hole, up to the next run (if any)
+            cpy_sz = size;
+            if (idx < inode->num_extents &&
+                (size_t)ext[idx].lblk * MEMBLOCK_SZ_B - offset < cpy_sz)
+                cpy_sz = (size_t)ext[idx].lblk * MEMBLOCK_SZ_B - offset;
+            if (to_buf)
+                memset(buf, 0, cpy_sz);
+        } else {
+            // Bytes from offset to the end of this run
+            size_t run_off = offset - (size_t)ext[idx].lblk * MEMBLOCK_SZ_B;
+            cpy_sz = (size_t)ext[idx].len * MEMBLOCK_SZ_B - run_off;
+            if (cpy_sz > size)
+                cpy_sz = size;
+
+            char *run = (char*)memblock_ptr(fs, ext[idx].pblk) + run_off;
+            if (!to_buf && inode->is_dir)
+                fs_journal(fs, run, cpy_sz);    // Dir tables are metadata
+            if (to_buf)
+                memcpy(buf, run, cpy_sz);
+            else if (buf)
+                memcpy(run, buf, cpy_sz);
+            else
+                memset(run, 0, cpy_sz);
+            if (!to_buf)
+                fs_dirty(fs, run, cpy_sz);
+            idx++;
+        }
+
+        if (buf)
+            buf += cpy_sz;
+        size -= cpy_sz;
+        offset += cpy_sz;
+    }
+}
+
+// Max num of ranges inode_data_segs gives for size bytes: one per block
+// spanned, at most one more than whole blocks at either end
+#define DATA_SEGS_MAX(size) ((size) / MEMBLOCK_SZ_B + 2)
+
+// A block of zeros, which the ranges of holes point to (see inode_data_segs)
+static const char zero_block[MEMBLOCK_SZ_B];
+
+// Describes the given inode's bytes [offset, offset + size) as ranges of the
+// fs memory, in order, into segs, copying nothing: one per contiguous run, and
+// one per block (or part) of a hole, pointing at zero_block. The ranges stay
+// the inode's bytes only while its lock is held.
+// Returns: The num of ranges put into segs, at most DATA_SEGS_MAX(size).
+// Assumes: If the inode is inline, the range lies within its inline room.
+static size_t inode_data_segs(FSHandle *fs, Inode *inode, size_t size,
+                              size_t offset, struct iovec *segs) {
+    size_t n = 0;
+
+    if (inode->is_inline) {
+        segs[0].iov_base = inode_inline_ptr(fs, inode) + offset;
+        segs[0].iov_len = size;
+        return size ? 1 : 0;
+    }
+
+    Extent *ext = inode_extents(fs, inode);
+    size_t idx = inode_extent_next(fs, inode, offset / MEMBLOCK_SZ_B);
+
+    while (size) {
+        size_t seg_sz;
+
+        if (idx == inode->num_extents || 
+            offset < (size_t)ext[idx].lblk * MEMBLOCK_SZ_B) {
+            // In a hole, up to the end of its block
+            seg_sz = MEMBLOCK_SZ_B - offset % MEMBLOCK_SZ_B;
+            if (seg_sz > size)
+                seg_sz = size;
+            segs[n].iov_base = (void*)zero_block;
+        } else {
+            // Bytes from offset to the end of this run
+            size_t run_off = offset - (size_t)ext[idx].lblk * MEMBLOCK_SZ_B;
+            seg_sz = (size_t)ext[idx].len * MEMBLOCK_SZ_B - run_off;
+            if (seg_sz > size)
+                seg_sz = size;
+            segs[n].iov_base = (char*)memblock_ptr(fs, ext[idx].pblk) + run_off;
+            idx++;
+        }
+        segs[n++].iov_len = seg_sz;
+
+        size -= seg_sz;
+        offset += seg_sz;
+    }
+    return n;
+}
+
+// Returns a ptr to the byte at offset of the given inode's data, or NULL if
+// that byte is not mapped.
+static void* inode_data_ptr(FSHandle *fs, Inode *inode, size_t offset) {
+    size_t lblk = offset / MEMBLOCK_SZ_B;
+    long idx = inode_extent_find(fs, inode, lblk);
+    if (idx < 0)
         return NULL;
+
+    Extent *ext = inode_extents(fs, inode) + idx;
+    return (char*)memblock_ptr(fs, ext->pblk + (lblk - ext->lblk)) + 
+           offset % MEMBLOCK_SZ_B;
+}
+
+
+/* End inode helpers ----------------------------------------------------- */
+/* Begin String Helpers -------------------------------------------------- */
+
+
+// Returns the length  of the given null-terminated char array
+size_t str_len(char *arr) {
+    int length = 0;
+    for (char *c = arr; *c != '\0'; c++)
+        length++;
+
+    return length;
+}
+
+// Splits a copy of the given absolute path into its parent dir path and its
+// name element. Ex: '/dir1/file1' gives '/dir1' and 'file1', and '/file1' 
+// gives '/' and 'file1'. Sets par_path and name to point into the copy.
+// Returns: The copy, to be freed by the caller (or NULL on alloc failure).
+static char* str_path_split(const char *path, char **par_path, char **name) {
+    size_t len = strlen(path);
+    char *sep = strrchr(path, *FS_PATH_SEP);
+    size_t par_len = (sep && sep != path) ? (size_t)(sep - path) : 0;
+    const char *name_start = sep ? sep + 1 : path;
+    char *copy = malloc(len + 3);   // +3 for root's sep and two null terms
+
+    if (!copy)
+        return NULL;
+
+    // Copy layout: "<par_path>\0<name>\0"
+    if (par_len)
+        memcpy(copy, path, par_len);
+    else
+        copy[par_len++] = *FS_PATH_SEP;     // Parent is root
+    copy[par_len] = '\0';
+    strcpy(copy + par_len + 1, name_start);
+
+    *par_path = copy;
+    *name = copy + par_len + 1;
+    return copy;
+}
+
+// Returns the 32-bit FNV-1a hash of the given null-terminated string
+static uint32_t str_hash(const char *str) {
+    uint32_t hash = UINT32_C(2166136261);
+
+    for (const char *c = str; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= UINT32_C(16777619);
+    }
+    return hash;
+}
+
+
+/* End String Helpers ---------------------------------------------------- */
+/* Begin Lookup cache helpers -------------------------------------------- */
+
+
+// Returns the cache slot num for the given path. The slot is guarded by
+// dcache_locks[slot % DCACHE_LOCKS].
+static size_t dcache_slot(const char *path) {
+    return str_hash(path) & (DCACHE_SLOTS - 1);
+}
+
+// Sets inodenum to the cached inode num of the given path.
+// Returns: 1 on a hit, else 0.
+static int dcache_get(const char *path, size_t *inodenum) {
+    size_t slot = dcache_slot(path);
+    DCacheEntry *entry = dcache + slot;
+    int hit;
+
+    pthread_mutex_lock(&dcache_locks[slot % DCACHE_LOCKS]);
+    hit = entry->gen == dcache_gen && strcmp(entry->path, path) == 0;
+    if (hit)
+        *inodenum = entry->inode;
+    pthread_mutex_unlock(&dcache_locks[slot % DCACHE_LOCKS]);
+
+    __atomic_add_fetch(hit ? &dcache_hits : &dcache_misses, 1, 
+                       __ATOMIC_RELAXED);
+    return hit;
+}
+
+// Caches the given path as resolving to inode num inodenum, replacing any
+// other path in its slot. Paths too long for an entry are not cached.
+static void dcache_put(const char *path, size_t inodenum) {
+    size_t slot = dcache_slot(path);
+    DCacheEntry *entry = dcache + slot;
+
+    if (strlen(path) >= DCACHE_PATH_MAXLEN)
+        return;
+
+    pthread_mutex_lock(&dcache_locks[slot % DCACHE_LOCKS]);
+    strcpy(entry->path, path);
+    entry->inode = inodenum;
+    entry->gen = dcache_gen;
+    pthread_mutex_unlock(&dcache_locks[slot % DCACHE_LOCKS]);
+}
+
+// Drops the given path from the cache, if cached.
+static void dcache_drop(const char *path) {
+    size_t slot = dcache_slot(path);
+    DCacheEntry *entry = dcache + slot;
+
+    pthread_mutex_lock(&dcache_locks[slot % DCACHE_LOCKS]);
+    if (entry->gen == dcache_gen && strcmp(entry->path, path) == 0)
+        entry->gen = 0;
+    pthread_mutex_unlock(&dcache_locks[slot % DCACHE_LOCKS]);
+}
+
+// Drops every path from the cache. On generation wrap, the entries are
+// cleared so none made UINT32_MAX generations ago may appear valid.
+// Note: Takes every stripe lock, so only for rare events (mount, dir moves).
+static void dcache_flush() {
+    for (size_t i = 0; i < DCACHE_LOCKS; i++)
+        pthread_mutex_lock(&dcache_locks[i]);
+
+    if (++dcache_gen == 0) {
+        memset(dcache, 0, sizeof(dcache));
+        dcache_gen = 1;
+    }
+
+    for (size_t i = 0; i < DCACHE_LOCKS; i++)
+        pthread_mutex_unlock(&dcache_locks[i]);
+}
+
+
+/* End Lookup cache helpers ---------------------------------------------- */
+/* Begin filesystem helpers ---------------------------------------------- */
+
+
+// Returns the root directory's inode for the given file system.
+static Inode* fs_rootnode_get(FSHandle *fs) {
+    return inode_get(fs, 0);
+}
+
+// Starts a new epoch with no blocks freed since the last checkpoint.
+// Assumes: mount_lock is held.
+static void fs_epoch_init() {
+    __atomic_store_n(&journal_num, 0, __ATOMIC_RELAXED);
+    journal_warned = 0;
+    frees_num = 0;
+    __atomic_store_n(&frees_blks, 0, __ATOMIC_RELAXED);
+}
+
+static void inode_open_reset();                                 // Prototype
+static void inode_orphan_reclaim(FSHandle *fs, Inode *inode);   // Prototype
+
+// Prepares an already formatted file system for use by this process. Any
+// metadata changes made after the last checkpoint are undone from the 
+// journal. The free block and inode counts are re-derived from the bitmap
+// and inode groups, so they hold even if the image was not cleanly 
+// unmounted, and orphans left by the last mount are released. The mounted 
+// state (before the release) is the first checkpoint.
+// Assumes: mount_lock is held.
+static void fs_mount(FSHandle *fs) {
+    journal_replay(fs);
+    fs->blocks_free = memblocks_numfree(fs);
+    fs->inodes_free = inodes_numfree(fs);
+    fs_epoch_init();
+    fs_dirty_init(fs, 0);
+    fs_dirty(fs, fs, ST_SZ_FSHANDLE);
+    dcache_flush();     // Paths cached for any other image are meaningless
+    inode_open_reset();
+
+    // Files unlinked while open are no longer open, so release them
+    while (fs->orphans)
+        inode_orphan_reclaim(fs, inode_get(fs, fs->orphans));
+    __atomic_store_n(&fs_mounted, (void*)fs, __ATOMIC_RELEASE);
+}
+
+// Widens the dirty and epoch maps from old_words to words words. The new 
+// blocks were not in use at the last checkpoint, so are marked safe. If 
+// there is no memory to widen the dirty map, changes go untracked.
+// Returns: 1 on success, else 0 (no memory for the epoch map).
+// Assumes: ns_lock is held exclusively, and no sync is under way.
+static int fs_dirty_grow(size_t old_words, size_t words) {
+    uint64_t *grown;
+
+    if (epoch_map) {
+        if (!(grown = realloc(epoch_map, words * sizeof(uint64_t))))
+            return 0;
+        epoch_map = grown;
+        memset(epoch_map + old_words, 0, 
+               (words - old_words) * sizeof(uint64_t));
+    }
+    if (dirty_map) {
+        if ((grown = realloc(dirty_map, words * sizeof(uint64_t)))) {
+            dirty_map = grown;
+            memset(dirty_map + old_words, 0, 
+                   (words - old_words) * sizeof(uint64_t));
+        } else {
+            free(dirty_map);
+            dirty_map = NULL;
+        }
+    }
+    return 1;
+}
+
+// Grows the given file system to n_blocks memory blocks, adding the new ones
+// to the free space. The bitmap grows in place while its blocks have room, 
+// else it moves to a run at the start of the new blocks.
+// Returns: 0 on success, else an errno (ENOMEM, or ENOSPC if the new blocks
+// cannot hold the moved bitmap).
+// Assumes: ns_lock is held exclusively, and no sync is under way.
+static int fs_grow(FSHandle *fs, size_t n_blocks) {
+    size_t old_n = fs->num_memblocks;
+    size_t old_words = (old_n + 63) / 64;
+    size_t words = (n_blocks + 63) / 64;
+    size_t old_map_blk = fs->offset_blkmap / MEMBLOCK_SZ_B;
+    size_t old_map_blks = fs->blkmap_blks;
+    size_t map_blks = bytes_to_blocks(words * sizeof(uint64_t));
+    int moved = map_blks > old_map_blks;
+    uint64_t *map = memblock_map(fs);
+
+    if (moved && old_n + map_blks >= n_blocks)
+        return ENOSPC;
+    if (!fs_dirty_grow(old_words, words))
+        return ENOMEM;
+    journal_marksafe(old_n, n_blocks - old_n);
+
+    // Copy the bitmap to its new blocks, if it moves. The old one is left 
+    // as is, for the last checkpoint.
+    if (moved) {
+        uint64_t *new_map = (uint64_t*)memblock_ptr(fs, old_n);
+        memcpy(new_map, map, old_words * sizeof(uint64_t));
+        map = new_map;
+    }
+
+    // Mark the words for the new blocks as all used, like the bits past the
+    // last block, then free the new blocks (but the moved bitmap's)
+    fs_journal(fs, &map[old_words], (words - old_words) * sizeof(uint64_t));
+    memset(&map[old_words], 0xff, (words - old_words) * sizeof(uint64_t));
+    fs_dirty(fs, map, words * sizeof(uint64_t));
+
+    pthread_mutex_lock(&alloc_lock);
+    fs_journal(fs, fs, ST_SZ_FSHANDLE);
+    if (moved) {
+        fs->offset_blkmap = old_n * MEMBLOCK_SZ_B;
+        fs->blkmap_blks = map_blks;
     }
+    fs->num_memblocks = n_blocks;
+    fs->size_b = n_blocks * MEMBLOCK_SZ_B;
+    memblock_mark(fs, old_n + (moved ? map_blks : 0), 
+                  n_blocks - old_n - (moved ? map_blks : 0), 0);
+    fs_dirty(fs, fs, ST_SZ_FSHANDLE);
+    pthread_mutex_unlock(&alloc_lock);
 
-    // Else, extract the subdir's inode offset
-    char *offset_ptr = strstr(subdir_ptr, FS_DIRDATA_SEP);
-    char *offsetend_ptr = strstr(subdir_ptr, FS_DIRDATA_END);
+    // Release the old bitmap, if it had already moved to data blocks
+    if (moved && old_map_blk >= fs->first_datablk)
+        memblock_free(fs, old_map_blk, old_map_blks);
 
-    if (!offset_ptr || !offsetend_ptr) {
-        printf("ERROR: Parse fail - Dir data may be corrupt -\n");
-        free(curr_data);
+    return 0;
+}
+
+// Returns a handle to a filesystem of size fssize onto fsptr.
+// If the fsptr not yet intitialized as a file system, it is formatted first.
+static FSHandle* fs_init(void *fsptr, size_t size) {
+    pthread_once(&locks_once, locks_init);
+
+    // Validate file system size
+    if (size < MIN_FS_SZ_B) {
+        printf("ERROR: File system size too small.\n");
         return NULL;
     }
 
-    // Get the subitem's offset
-    size_t offset;
-    size_t offset_sz = offsetend_ptr - offset_ptr;
-    char *offset_str = malloc(offset_sz);
-    memcpy(offset_str, offset_ptr + 1, offset_sz - 1);  // +/- 1 excludes sep
-    sscanf(offset_str, "%zu", &offset);                 // str to size_t
-    Inode *subdir_inode = (Inode*)ptr_from_offset(fs, (size_t*)offset);
+    // Map file system structure onto the given memory space
+    FSHandle *fs = (FSHandle*)fsptr;
 
-    // Cleanup
-    free(curr_data);
-    free(offset_str);
-    
-    if (strcmp(subdir_inode->name, name) != 0)
+    // If this process already mounted the image, no locking is needed. (Its
+    // size is not checked, as a caller may pass the size from before a grow)
+    if (__atomic_load_n(&fs_mounted, __ATOMIC_ACQUIRE) == fsptr)
+        return fs;
+
+    // Else, only one thread may mount or format it
+    pthread_mutex_lock(&mount_lock);
+
+    // If already intitialized, the handle persisted in the image is valid.
+    // (Another thread may have mounted, then grown it, while this one waited)
+    if (fsptr == fs_mounted || (fs->magic == MAGIC_NUM && fs->size_b <= size)) {
+        if (fsptr != fs_mounted)
+            fs_mount(fs);   // First use of this image by this process
+        pthread_mutex_unlock(&mount_lock);
+        return fs;
+    }
+
+    size_t n_blocks = size / MEMBLOCK_SZ_B;         // Total blocks, incl. fs's
+    if (n_blocks > NAME_MAX_BLKS)
+        n_blocks = NAME_MAX_BLKS;                   // Past name heap's reach
+    size_t map_words = (n_blocks + 63) / 64;        // Words in block bitmap
+    size_t map_blks = bytes_to_blocks(map_words * sizeof(uint64_t));
+    size_t jrnl_blks = journal_size(n_blocks);      // Blocks for journal
+
+    // Format mem space w/zero-fill
+    memset(fsptr, 0, n_blocks * MEMBLOCK_SZ_B);
+
+    // Populate fs data members
+    fs->magic = MAGIC_NUM;
+    fs->size_b = n_blocks * MEMBLOCK_SZ_B;
+    fs->num_memblocks = n_blocks;
+    fs->offset_blkmap = FS_START_OFFSET;
+    fs->blkmap_blks = map_blks;
+    fs->offset_journal = fs->offset_blkmap + map_blks * MEMBLOCK_SZ_B;
+    fs->journal_blks = jrnl_blks;
+    fs->first_datablk = 1 + map_blks + jrnl_blks;
+    fs->blocks_free = map_words * 64;   // Every bit in the map starts clear
+    fs_epoch_init();
+    fs_dirty_init(fs, 1);
+
+    // Reserve the blocks holding the handle, bitmap and journal, and the bits
+    // past the last block so word scans never return them
+    memblock_mark(fs, 0, fs->first_datablk, 1);
+    memblock_mark(fs, n_blocks, map_words * 64 - n_blocks, 1);
+
+    // Give the first data blocks to the inode map and the first inode group
+    fs->imap_blk = fs->first_datablk;
+    fs->imap_blks = 1;
+    memblock_mark(fs, fs->imap_blk, 2, 1);
+    fs->alloc_hint = fs->imap_blk + 2;
+    inode_group_init(fs, fs->imap_blk + 1);
+
+    // Set up 0th inode as the root directory having path FS_PATH_SEP
+    Inode *root_inode = fs_rootnode_get(fs);
+    root_inode->not_free = 1;
+    root_inode->is_dir = 1;
+    root_inode->subdirs = 0;
+    inode_lasttimes_set(fs, root_inode, 1);
+
+    fs_dirty_blocks(0, n_blocks);   // All of the image is freshly written
+    dcache_flush();
+    inode_open_reset();
+    __atomic_store_n(&fs_mounted, fsptr, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mount_lock);
+
+    return fs;  // Return handle to the file system
+}
+
+
+// Makes the current state of the file system a checkpoint: blocks freed 
+// since the last one are marked free, all changes are written back by flush
+// (see fs_dirty_flushall) and the journal is emptied.
+// Returns: 1 on success, else 0 (the last checkpoint is kept).
+// Assumes: sync_lock is held, and ns_lock exclusively, so the state is 
+// consistent.
+static int fs_checkpoint(FSHandle *fs, int (*flush)(void *, size_t, size_t),
+                         void *flushctx, size_t *flushed) {
+    pthread_mutex_lock(&alloc_lock);
+    for (size_t i = 0; i < frees_num; i++)
+        memblock_mark(fs, frees[i].blk, frees[i].len, 0);
+    pthread_mutex_unlock(&alloc_lock);
+
+    // If not all written back, the freed blocks must stay unused until the
+    // next try, as the last checkpoint still needs their data
+    if (!fs_dirty_flushall(fs, flush, flushctx, flushed)) {
+        pthread_mutex_lock(&alloc_lock);
+        for (size_t i = 0; i < frees_num; i++)
+            memblock_mark(fs, frees[i].blk, frees[i].len, 1);
+        pthread_mutex_unlock(&alloc_lock);
+        return 0;
+    }
+
+    frees_num = 0;
+    __atomic_store_n(&frees_blks, 0, __ATOMIC_RELAXED);
+
+    journal_reset(fs);
+    return 1;
+}
+
+// Moves the journal to a run of free blocks sized for the file system, if it
+// has grown to warrant a journal at least twice as large. The move is made 
+// right after a checkpoint, while the journal is empty, by a single durable
+// write of the handle, so a crash finds either journal empty.
+// Assumes: sync_lock is held, and ns_lock exclusively.
+static void fs_journal_grow(FSHandle *fs) {
+    size_t want = journal_size(fs->num_memblocks);
+    size_t old_blk = fs->offset_journal / MEMBLOCK_SZ_B;
+    size_t old_n = fs->journal_blks;
+    size_t got = 0, flushed = 0;
+    size_t blk;
+
+    if (want < old_n * 2 || !(blk = memblock_alloc(fs, 0, want, 1, &got)))
+        return;     // Keep the current journal
+
+    if (!fs_checkpoint(fs, fs_msync, fs, &flushed)) {
+        memblock_free(fs, blk, want);
+        return;
+    }
+
+    memset(memblock_ptr(fs, blk), 0, MEMBLOCK_SZ_B);    // Empty head
+    fs_msync(fs, blk * MEMBLOCK_SZ_B, MEMBLOCK_SZ_B);
+    pthread_mutex_lock(&alloc_lock);
+    fs->offset_journal = blk * MEMBLOCK_SZ_B;
+    __atomic_store_n(&fs->journal_blks, want, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&alloc_lock);
+    fs_msync(fs, 0, ST_SZ_FSHANDLE);
+
+    // Release the old journal, if it had already moved to data blocks
+    if (old_blk >= fs->first_datablk)
+        memblock_free(fs, old_blk, old_n);
+}
+
+// Returns 1 if the file system should make a checkpoint before the next op,
+// as the journal is half full or blocks awaiting one outnumber free blocks.
+static int fs_checkpoint_due(FSHandle *fs) {
+    return __atomic_load_n(&journal_num, __ATOMIC_RELAXED) >= 
+           journal_cap(fs) / 2 ||
+           __atomic_load_n(&frees_blks, __ATOMIC_RELAXED) > 
+           __atomic_load_n(&fs->blocks_free, __ATOMIC_RELAXED);
+}
+
+// Returns a handle to a myfs filesystem on success, making a checkpoint 
+// first if one is due.
+// On fail, sets errnoptr to EFAULT and returns NULL.
+static FSHandle *fs_handle(void *fsptr, size_t fssize, int *errnoptr) {
+    FSHandle *fs = fs_init(fsptr, fssize);
+    size_t flushed = 0;
+
+    if (!fs && errnoptr) *errnoptr = EFAULT;
+
+    if (fs && fs_checkpoint_due(fs)) {
+        pthread_mutex_lock(&sync_lock);
+        fs_lock_ns(1);
+        if (fs_checkpoint_due(fs))
+            fs_checkpoint(fs, fs_msync, fs, &flushed);
+        fs_unlock_ns();
+        pthread_mutex_unlock(&sync_lock);
+    }
+    return fs;
+}
+
+// A debug function to simulate a resolve_path() call. 
+// Returns some hardcoded test inode (ex: the root dir).
+// On fail, sets errnoptr to ENOENT and returns NULL.
+// Assumes: path is absolute.
+static Inode *fs_pathresolve(FSHandle *fs, const char *path, int *errnoptr) {
+    // Ensure at least root dir symbol present
+    if (strncmp(path, FS_PATH_SEP, 1) != 0) {
+        *errnoptr = EINVAL;
+        return NULL;                
+    }
+
+    Inode *inode = resolve_path(fs, path);
+    if (!inode && errnoptr) *errnoptr = ENOENT;
+    return inode;
+}
+
+
+/* End Filesystem Helpers ------------------------------------------------- */
+/* Begin Inode helpers ---------------------------------------------------- */
+
+
+// Copies up to size bytes of the given inode's data, starting at offset, into
+// buf. Only the requested range is copied.
+// Returns: The number of bytes copied (0 if offset is at/past end of data).
+static size_t inode_data_read(FSHandle *fs, Inode *inode, char *buf,
+                              size_t size, size_t offset) {
+    inode_lasttimes_set(fs, inode, 0);
+    if (offset >= inode->file_size_b)
+        return 0;
+    if (size > inode->file_size_b - offset)
+        size = inode->file_size_b - offset;
+
+    inode_data_xfer(fs, inode, buf, size, offset, 1);
+    return size;
+}
+
+// Disassociates any data from inode and frees the memblocks it used,
+// including any indirect extent run.
+static void inode_data_remove(FSHandle *fs, Inode *inode) {
+    Extent *ext = inode_extents(fs, inode);
+
+    inode_journal(fs, inode);
+    if (inode->is_inline == INLINE_HEAP)
+        heap_free(fs, inode->heap_ref, inode->heap_class);
+    for (size_t i = 0; i < inode->num_extents; i++)
+        memblock_free(fs, ext[i].pblk, ext[i].len);
+    if (inode->is_indirect)
+        memblock_free(fs, inode->extblk, inode->extblk_n);
+
+    // Update the inode to reflect the disassociation
+    inode->num_extents = 0;
+    inode->is_inline = 0;
+    inode->is_indirect = 0;
+    memset(inode->inline_data, 0, INODE_INLINE_MAX);    // Empty extent map
+    inode->file_size_b = 0;
+    inode_lasttimes_set(fs, inode, 1);
+}
+
+static size_t inode_data_write(FSHandle *fs, Inode *inode, const char *buf,
+                               size_t size, size_t offset);   // Prototype
+
+// Forgets all open handles, for a newly mounted or formatted image.
+static void inode_open_reset() {
+    pthread_mutex_lock(&open_lock);
+    if (open_counts)
+        memset(open_counts, 0, open_cap * sizeof(uint32_t));
+    pthread_mutex_unlock(&open_lock);
+}
+
+// Counts a new open handle to the given inode.
+// Returns: 1 on success, else 0 (no memory to count it).
+// Assumes: ns_lock is held, so the inode stays in use.
+static int inode_open(FSHandle *fs, Inode *inode) {
+    size_t num = inode_num(fs, inode);
+    int res = 1;
+
+    pthread_mutex_lock(&open_lock);
+    if (num >= open_cap) {
+        size_t cap = fs->num_inodes;
+        uint32_t *grown = realloc(open_counts, cap * sizeof(uint32_t));
+        if (grown) {
+            memset(grown + open_cap, 0, (cap - open_cap) * sizeof(uint32_t));
+            open_counts = grown;
+            open_cap = cap;
+        }
+    }
+    if (num < open_cap)
+        open_counts[num]++;
+    else
+        res = 0;
+    pthread_mutex_unlock(&open_lock);
+    return res;
+}
+
+// Returns 1 if the given inode has open handles, else 0.
+// Assumes: ns_lock is held exclusively, so no handles are being opened.
+static int inode_isopen(FSHandle *fs, Inode *inode) {
+    size_t num = inode_num(fs, inode);
+    int res;
+
+    pthread_mutex_lock(&open_lock);
+    res = num < open_cap && (open_counts[num] & ~INODE_ORPHANED);
+    pthread_mutex_unlock(&open_lock);
+    return res;
+}
+
+// Returns 1 if the given inode was unlinked and awaits its last release.
+// Assumes: ns_lock is held.
+static int inode_isorphan(FSHandle *fs, Inode *inode) {
+    size_t num = inode_num(fs, inode);
+    int res;
+
+    pthread_mutex_lock(&open_lock);
+    res = num < open_cap && (open_counts[num] & INODE_ORPHANED);
+    pthread_mutex_unlock(&open_lock);
+    return res;
+}
+
+// Drops n open handles to the inode numbered num.
+// Returns: 1 if they were the last handles to an orphan, which must now be
+// reclaimed (see inode_orphan_reclaim), else 0.
+static int inode_release(size_t num, size_t n) {
+    int last = 0;
+
+    pthread_mutex_lock(&open_lock);
+    if (num < open_cap && (open_counts[num] & ~INODE_ORPHANED)) {
+        size_t held = open_counts[num] & ~INODE_ORPHANED;
+        open_counts[num] -= (n < held) ? n : held;
+        if (open_counts[num] == INODE_ORPHANED) {
+            open_counts[num] = 0;
+            last = 1;
+        }
+    }
+    pthread_mutex_unlock(&open_lock);
+    return last;
+}
+
+// Releases the given inode, whose last name was just removed: at once, or if
+// it is open, at its last release. Until then it keeps its data, and is kept
+// on the orphan list, so a crash before then cannot leak it (see fs_mount).
+// Assumes: ns_lock is held exclusively.
+static void inode_unlinked(FSHandle *fs, Inode *inode) {
+    size_t num = inode_num(fs, inode);
+
+    if (!inode_isopen(fs, inode)) {
+        inode_data_remove(fs, inode);
+        inode_free(fs, inode);
+        return;
+    }
+
+    inode_journal(fs, inode);
+    if (inode->name)
+        name_free(fs, inode->name);
+    pthread_mutex_lock(&alloc_lock);
+    fs_journal(fs, fs, ST_SZ_FSHANDLE);
+    inode->next_free = fs->orphans;
+    fs->orphans = (uint32_t)num;
+    inode_dirty(fs, inode);
+    fs_dirty(fs, fs, ST_SZ_FSHANDLE);
+    pthread_mutex_unlock(&alloc_lock);
+
+    pthread_mutex_lock(&open_lock);
+    open_counts[num] |= INODE_ORPHANED;
+    pthread_mutex_unlock(&open_lock);
+}
+
+// Returns a ptr to the inode the open handle fh refers to.
+// On fail (not an inode in use), sets errnoptr to EBADF and returns NULL.
+// Assumes: ns_lock is held.
+static Inode* inode_from_fh(FSHandle *fs, uint64_t fh, int *errnoptr) {
+    Inode *inode;
+
+    if (fh >= fs->num_inodes || inode_isfree(inode = inode_get(fs, fh))) {
+        *errnoptr = EBADF;
+        return NULL;
+    }
+    return inode;
+}
+
+// Takes the given orphan off the orphan list and releases it.
+// Assumes: ns_lock is held exclusively (or mount_lock, when mounting), and 
+// the orphan has no open handles.
+static void inode_orphan_reclaim(FSHandle *fs, Inode *inode) {
+    uint32_t num = (uint32_t)inode_num(fs, inode);
+    uint32_t *link = &fs->orphans;
+
+    while (*link && *link != num)
+        link = &inode_get(fs, *link)->next_free;
+    if (*link) {
+        fs_journal(fs, link, sizeof(uint32_t));
+        *link = inode->next_free;
+        fs_dirty(fs, link, sizeof(uint32_t));
+    }
+
+    inode_journal(fs, inode);
+    inode->next_free = 0;               // No name to free
+    inode_data_remove(fs, inode);
+    inode_free(fs, inode);
+}
+
+// Makes room for size bytes of the given inline file's data, moving it to a
+// large enough slot of the name heap if size is at most INLINE_HEAP_MAX, else
+// out to blocks. Bytes past the data in its new place read as zeros.
+// Returns: 1 on success, else 0 (fs is full, the data is left in place).
+static int inode_inline_grow(FSHandle *fs, Inode *inode, size_t size) {
+    char data[INLINE_HEAP_MAX];
+    size_t file_sz = inode->file_size_b;
+    Inode old = *inode;
+
+    memcpy(data, inode_inline_ptr(fs, inode), file_sz);
+
+    if (size <= INLINE_HEAP_MAX) {
+        size_t c = heap_class(size);
+        size_t slot_sz = NAME_GRAIN << c;
+        uint32_t ref = heap_alloc(fs, c);
+        if (!ref)
+            return 0;
+
+        char *slot = name_ptr(fs, ref);
+        fs_journal(fs, slot, slot_sz);
+        memcpy(slot, data, file_sz);
+        memset(slot + file_sz, 0, slot_sz - file_sz);
+        fs_dirty(fs, slot, slot_sz);
+
+        inode_journal(fs, inode);
+        inode->is_inline = INLINE_HEAP;
+        inode->heap_ref = ref;
+        inode->heap_class = (uint32_t)c;
+        inode_dirty(fs, inode);
+    } else {
+        inode_journal(fs, inode);
+        inode->is_inline = 0;
+        memset(inode->inline_data, 0, INODE_INLINE_MAX);    // Empty extent map
+        inode_dirty(fs, inode);
+
+        if (file_sz && inode_data_write(fs, inode, data, file_sz, 0) < file_sz) {
+            inode->is_inline = old.is_inline;               // Nothing was mapped
+            memcpy(inode->inline_data, old.inline_data, INODE_INLINE_MAX);
+            return 0;
+        }
+    }
+
+    if (old.is_inline == INLINE_HEAP)
+        heap_free(fs, old.heap_ref, old.heap_class);
+    return 1;
+}
+
+// Readies the given inode's bytes [offset, offset + size) to be written in
+// place with the bytes of buf (see inode_data_write): an empty file takes the
+// data inline if it fits, and an inline file moves to a larger slot, or to 
+// blocks, once it no longer does. Otherwise, new blocks are mapped for holes in the range, but
+// for whole blocks of zeros in buf (none if buf is NULL), and the parts of
+// new blocks outside the range are zeroed. Sizes and times are not updated.
+// Returns: The end of the part of the range that is ready (offset if none, 
+// as the fs is full).
+static size_t inode_data_prepare(FSHandle *fs, Inode *inode, const char *buf,
+                                 size_t size, size_t offset) {
+    size_t end = offset + size;
+
+    if (!inode->is_dir && !inode->is_inline && !inode->file_size_b && 
+        !inode->num_extents && end <= INLINE_HEAP_MAX) {
+        inode_journal(fs, inode);
+        inode->is_inline = INLINE_INODE;
+        memset(inode->inline_data, 0, INODE_INLINE_MAX);
+        inode_dirty(fs, inode);
+    }
+    if (inode->is_inline && end > inode_inline_cap(inode) && 
+        !inode_inline_grow(fs, inode, end))
+        return offset;  // No room for the data in a larger place
+    if (inode->is_inline)
+        return end;
+
+    size_t first = offset / MEMBLOCK_SZ_B;
+    size_t last = bytes_to_blocks(end);
+
+    // Note which partly written blocks are holes, so their rest is zeroed
+    int head_new = offset % MEMBLOCK_SZ_B && 
+                   inode_extent_find(fs, inode, first) < 0;
+    int tail_new = end % MEMBLOCK_SZ_B && 
+                   inode_extent_find(fs, inode, last - 1) < 0;
+
+    // Map any holes in the range, clamping to what fits
+    size_t mapped_end = inode_blocks_map(fs, inode, first, last, buf, 
+                                         size, offset);
+    if (mapped_end < last) {
+        end = mapped_end * MEMBLOCK_SZ_B;
+        tail_new = 0;
+    }
+    if (end <= offset)
+        return offset;  // Out of space before reaching offset
+
+    if (head_new)
+        inode_data_xfer(fs, inode, NULL, offset % MEMBLOCK_SZ_B, 
+                        first * MEMBLOCK_SZ_B, 0);
+    if (tail_new)
+        inode_data_xfer(fs, inode, NULL, 
+                        MEMBLOCK_SZ_B - end % MEMBLOCK_SZ_B, end, 0);
+    return end;
+}
+
+// Writes size bytes from buf into the given inode's data at offset, in place.
+// An empty file takes the data inline if it fits, and an inline file moves to
+// a larger slot, or to blocks, once it no longer does. Otherwise, only the blocks covering the range
+// are touched, and new blocks are mapped only for holes in it. Whole blocks of
+// zeros written into a hole leave it a hole, and the parts of new blocks 
+// outside the range are zeroed. Writing past the current end leaves a hole
+// between. Data after offset + size is kept. 
+// Returns: The number of bytes of buf written (less than size if fs is full).
+static size_t inode_data_write(FSHandle *fs, Inode *inode, const char *buf,
+                               size_t size, size_t offset) {
+    size_t end = inode_data_prepare(fs, inode, buf, size, offset);
+
+    if (end > offset) {
+        inode_data_xfer(fs, inode, (char*)buf, end - offset, offset, 0);
+
+        // Update size (if grown)
+        if (end > inode->file_size_b) {
+            inode_journal(fs, inode);
+            inode->file_size_b = end;
+        }
+    }
+    inode_lasttimes_set(fs, inode, 1);
+
+    return end - offset;
+}
+
+// Exchanges the data of the two given inodes (their extent maps, or inline
+// data, and sizes), moving no blocks.
+static void inode_data_swap(FSHandle *fs, Inode *a, Inode *b) {
+    Inode t = *a;
+
+    inode_journal(fs, a);
+    inode_journal(fs, b);
+    a->is_inline = b->is_inline;
+    a->is_indirect = b->is_indirect;
+    a->num_extents = b->num_extents;
+    a->file_size_b = b->file_size_b;
+    memcpy(a->inline_data, b->inline_data, INODE_INLINE_MAX);
+    b->is_inline = t.is_inline;
+    b->is_indirect = t.is_indirect;
+    b->num_extents = t.num_extents;
+    b->file_size_b = t.file_size_b;
+    memcpy(b->inline_data, t.inline_data, INODE_INLINE_MAX);
+    inode_dirty(fs, a);
+    inode_dirty(fs, b);
+}
+
+// Sets data field and updates size fields for the file or dir denoted by
+// inode, replacing any existing data.
+// Assumes: Filesystem has enough free memblocks to accomodate data.
+static void inode_data_set(FSHandle *fs, Inode *inode, char *data, size_t sz) {
+    inode_data_remove(fs, inode);
+    inode_data_write(fs, inode, data, sz, 0);
+}
+
+// Sets the size of the given inode's data to size bytes. Shrinking frees
+// only the blocks past the new end and zeros the rest of the new last block.
+// Growing maps nothing: the new bytes are a hole. O(blocks freed).
+// Returns: 1 on success, else 0 (no room to move inline data to grow it).
+static int inode_data_truncate(FSHandle *fs, Inode *inode, size_t size) {
+    size_t file_sz = inode->file_size_b;
+    size_t mapped;
+
+    if (inode->is_inline && size > inode_inline_cap(inode) && 
+        !inode_inline_grow(fs, inode, size))
+        return 0;
+
+    if (inode->is_inline) {
+        mapped = inode_inline_cap(inode);
+    } else {
+        if (size < file_sz)
+            inode_blocks_shrink(fs, inode, bytes_to_blocks(size));
+        mapped = inode_numblocks(fs, inode) * MEMBLOCK_SZ_B;
+    }
+
+    // Clear stale bytes from the new (or old, if growing) end to the end of
+    // its block (or of the inline data), so they read as zeros
+    size_t from = (size < file_sz) ? size : file_sz;
+    if (from < mapped)
+        inode_data_xfer(fs, inode, NULL, mapped - from, from, 0);
+
+    inode_journal(fs, inode);
+    inode->file_size_b = size;
+    inode_lasttimes_set(fs, inode, 1);
+    return 1;
+}
+
+
+/* End Inode helpers ------------------------------------------------------ */
+/* Begin Directory helpers ------------------------------------------------ */
+
+
+// Returns a ptr to the given directory's DirHead, or NULL if it has no table.
+static DirHead* dir_head(FSHandle *fs, Inode *dir) {
+    if (!dir->file_size_b)
+        return NULL;
+    return (DirHead*)inode_data_ptr(fs, dir, 0);
+}
+
+// Returns a ptr to the given directory's table slot numbered slot.
+// Note: Slots never straddle blocks, as DirHead and DirEntry divide a block.
+static DirEntry* dir_slot(FSHandle *fs, Inode *dir, size_t slot) {
+    return (DirEntry*)inode_data_ptr(fs, dir, 
+                                     ST_SZ_DIRHEAD + slot * ST_SZ_DIRENTRY);
+}
+
+// Returns the inode num of the given directory's parent dir.
+static uint32_t dir_parent(FSHandle *fs, Inode *dir) {
+    DirHead *head = dir_head(fs, dir);
+    return head ? head->parent : dir->parent;
+}
+
+// Sets the inode num of the given directory's parent dir to parent.
+static void dir_parent_set(FSHandle *fs, Inode *dir, uint32_t parent) {
+    DirHead *head = dir_head(fs, dir);
+
+    if (head) {
+        fs_journal(fs, head, ST_SZ_DIRHEAD);
+        head->parent = parent;
+        fs_dirty(fs, head, ST_SZ_DIRHEAD);
+    } else {
+        inode_journal(fs, dir);
+        dir->parent = parent;
+        inode_dirty(fs, dir);
+    }
+}
+
+// Returns 1 if the given directory has no children, else 0.
+static int dir_isempty(FSHandle *fs, Inode *dir) {
+    DirHead *head = dir_head(fs, dir);
+    return (!head || !head->num_entries);
+}
+
+// Returns the slot of the given directory's table holding the child named 
+// name, or NULL if there is no such child. O(1) expected, no heap allocation.
+static DirEntry* dir_entry_find(FSHandle *fs, Inode *dir, const char *name) {
+    DirHead *head = dir_head(fs, dir);
+    if (!head)
+        return NULL;
+
+    uint32_t hash = str_hash(name);
+    size_t mask = head->num_slots - 1;
+
+    for (size_t i = hash & mask, n = 0; n < head->num_slots; i = (i + 1) & mask, n++) {
+        DirEntry *entry = dir_slot(fs, dir, i);
+
+        if (entry->inode == DIRENT_FREE)
+            return NULL;                        // End of probe sequence
+        if (entry->inode != DIRENT_TOMB && entry->hash == hash &&
+            strcmp(inode_name(fs, inode_get(fs, entry->inode)), name) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+// Places a (hash, ino) entry in the first free or tombstoned slot of the
+// given directory's table along its probe sequence.
+// Assumes: The table has at least one free slot.
+static void dir_entry_place(FSHandle *fs, Inode *dir, uint32_t hash, 
+                            uint32_t ino) {
+    DirHead *head = dir_head(fs, dir);
+    size_t mask = head->num_slots - 1;
+    size_t i = hash & mask;
+    DirEntry *entry = dir_slot(fs, dir, i);
+
+    while (entry->inode != DIRENT_FREE && entry->inode != DIRENT_TOMB) {
+        i = (i + 1) & mask;
+        entry = dir_slot(fs, dir, i);
+    }
+
+    fs_journal(fs, entry, ST_SZ_DIRENTRY);
+    fs_journal(fs, head, ST_SZ_DIRHEAD);
+    if (entry->inode == DIRENT_TOMB)
+        head->num_tombs--;
+    entry->hash = hash;
+    entry->inode = ino;
+    head->num_entries++;
+    fs_dirty(fs, entry, ST_SZ_DIRENTRY);
+    fs_dirty(fs, head, ST_SZ_DIRHEAD);
+}
+
+// Rebuilds the given directory's table with num_slots slots, dropping any
+// tombstones. The new table is built in fresh blocks, held by a scratch inode,
+// before the old one is released: blocks freed since the last checkpoint are
+// not reusable until the next one, so the old ones can't make room for it.
+// If the fs lacks room for the new table, the old one is left untouched.
+// Returns: 1 if the table now has num_slots slots, else 0.
+// Assumes: ns_lock is held exclusively.
+static int dir_resize(FSHandle *fs, Inode *dir, size_t num_slots) {
+    DirHead *head = dir_head(fs, dir);
+    size_t old_slots = head ? head->num_slots : 0;
+    size_t new_sz = ST_SZ_DIRHEAD + num_slots * ST_SZ_DIRENTRY;
+    uint32_t parent = dir_parent(fs, dir);
+    Inode *tmp;
+
+    if (!(tmp = inode_alloc(fs)))
+        return 0;
+    inode_journal(fs, tmp);
+    tmp->is_dir = 1;                    // So its blocks are journaled
+    inode_dirty(fs, tmp);
+    if (inode_data_write(fs, tmp, NULL, new_sz, 0) < new_sz) {
+        inode_data_remove(fs, tmp);
+        inode_free(fs, tmp);
+        return 0;
+    }
+
+    // Place the live entries straight from the old table into the new
+    fs_journal(fs, dir_head(fs, tmp), ST_SZ_DIRHEAD);
+    dir_head(fs, tmp)->num_slots = num_slots;
+    dir_head(fs, tmp)->parent = parent;
+    fs_dirty(fs, dir_head(fs, tmp), ST_SZ_DIRHEAD);
+    for (size_t i = 0; i < old_slots; i++) {
+        DirEntry *entry = dir_slot(fs, dir, i);
+        if (entry->inode != DIRENT_FREE && entry->inode != DIRENT_TOMB)
+            dir_entry_place(fs, tmp, entry->hash, entry->inode);
+    }
+
+    // Give the new table to the dir, and free the old one with the scratch
+    inode_data_swap(fs, dir, tmp);
+    inode_data_remove(fs, tmp);
+    inode_free(fs, tmp);
+    inode_lasttimes_set(fs, dir, 1);
+    return 1;
+}
+
+// Ensures the given directory's table has room for one more entry, growing
+// it first if it would become over 3/4 full.
+// Returns: 1 on success, else 0 (fs is full).
+static int dir_entry_reserve(FSHandle *fs, Inode *dir) {
+    DirHead *head = dir_head(fs, dir);
+    size_t used = head ? head->num_entries + head->num_tombs + 1 : 1;
+
+    if (!head || used * 4 > head->num_slots * 3) {
+        size_t num_slots = DIR_MIN_SLOTS;
+        size_t num_entries = head ? head->num_entries + 1 : 1;
+        while (num_entries * 2 > num_slots)
+            num_slots *= 2;
+        if (!dir_resize(fs, dir, num_slots) && !dir_head(fs, dir))
+            return 0;
+        head = dir_head(fs, dir);
+        if ((head->num_entries + head->num_tombs + 1) > head->num_slots - 1)
+            return 0;   // Kept the old size and it is full
+    }
+    return 1;
+}
+
+// Adds an entry for the given child inode to the given directory's table,
+// growing the table first if needed.
+// Returns: 1 on success, else 0 (fs is full).
+// Assumes: The dir has no child by the same name.
+static int dir_entry_add(FSHandle *fs, Inode *dir, Inode *child) {
+    if (!dir_entry_reserve(fs, dir))
+        return 0;
+
+    dir_entry_place(fs, dir, str_hash(inode_name(fs, child)), 
+                    inode_num(fs, child));
+    inode_lasttimes_set(fs, dir, 1);
+    return 1;
+}
+
+// Tombstones the given slot of the given directory's table. The table is 
+// released entirely once the directory is empty.
+static void dir_entry_drop(FSHandle *fs, Inode *dir, DirEntry *entry) {
+    DirHead *head = dir_head(fs, dir);
+    fs_journal(fs, entry, ST_SZ_DIRENTRY);
+    fs_journal(fs, head, ST_SZ_DIRHEAD);
+    entry->inode = DIRENT_TOMB;
+    head->num_entries--;
+    head->num_tombs++;
+    fs_dirty(fs, entry, ST_SZ_DIRENTRY);
+    fs_dirty(fs, head, ST_SZ_DIRHEAD);
+
+    if (!head->num_entries) {
+        uint32_t parent = head->parent;
+        inode_data_remove(fs, dir);
+        dir_parent_set(fs, dir, parent);    // Back in the inode
+    }
+
+    inode_lasttimes_set(fs, dir, 1);
+}
+
+// Removes the entry for the child named name from the given directory's
+// table. The table is released entirely once the directory is empty.
+// Returns: 1 on success, else 0 (no such child).
+static int dir_entry_remove(FSHandle *fs, Inode *dir, const char *name) {
+    DirEntry *entry = dir_entry_find(fs, dir, name);
+    if (!entry)
+        return 0;
+
+    dir_entry_drop(fs, dir, entry);
+    return 1;
+}
+
+// Returns the inode for the given item (a sub-directory or file) having the
+// parent directory given by inode (Or NULL if item could not be found).
+static Inode* dir_subitem_get(FSHandle *fs, Inode *inode, char *name) {
+    if (!inode || !inode_isdir(inode))
+        return NULL;
+
+    DirEntry *entry = dir_entry_find(fs, inode, name);
+    if (!entry)
         return NULL;        // Path not found
 
-    return subdir_inode;    // Success
+    return inode_get(fs, entry->inode);    // Success
 }
 
 // Creates a new/empty sub-directory under the parent dir specified by inode.
 // Returns: A ptr to the newly created dir's inode on success, else NULL.
 static Inode* dir_new(FSHandle *fs, Inode *inode, char *dirname) {
     // Validate...
-    if (!inode_isdir(inode)) {
+    if (!inode || !inode_isdir(inode)) {
         // printf("ERROR: %s is not a directory\n", dirname);
         return NULL; 
     } 
@@ -657,126 +2707,180 @@ static Inode* dir_new(FSHandle *fs, Inode *inode, char *dirname) {
     }
 
     // Begin creating the new directory...
-    Inode *newdir_inode = inode_nextfree(fs);
-    MemHead *newdir_memblock = memblock_nextfree(fs);
-    newdir_inode->offset_firstblk = (size_t*)offset_from_ptr(fs, 
-        (void*)newdir_memblock);
+    Inode *newdir_inode = inode_alloc(fs);
 
-    if (newdir_inode == NULL || newdir_memblock == NULL) {
+    if (newdir_inode == NULL) {
         printf("ERROR: Failed to get resources adding %s\n", dirname);
         return NULL;
     }
 
-    // Get the new inode's offset
-    size_t offset = offset_from_ptr(fs, newdir_inode);        
-    char offset_str[digits_count(offset) + 1];      
-    snprintf(offset_str, sizeof(offset_str), "%lu", offset);
-
-    // Build new directory's lookup line Ex: "dirname:offset\n"
-    size_t data_sz = 0;
-    data_sz = str_len(dirname) + str_len(offset_str) + 2; // +2 for : and \n
-    char *data = malloc(data_sz);
-
-    strcpy(data, dirname);
-    strcat(data, FS_DIRDATA_SEP);
-    strcat(data, offset_str);
-    strcat(data, FS_DIRDATA_END);
+    // Set new dir's properties. Its table is created with its first child.
+    if (!inode_name_set(fs, newdir_inode, dirname)) {
+        inode_free(fs, newdir_inode);
+        return NULL;
+    }
+    newdir_inode->is_dir = 1;
+    dir_parent_set(fs, newdir_inode, inode_num(fs, inode));
+    inode_lasttimes_set(fs, newdir_inode, 1);
 
-    // Append the lookup line to the parent dir's existing lookup table
-    inode_data_append(fs, inode, data);
+    // Add the new dir to the parent dir's table
+    if (!dir_entry_add(fs, inode, newdir_inode)) {
+        inode_free(fs, newdir_inode);
+        return NULL;
+    }
     
     // Update parent dir properties
-    *(int*)(&inode->subdirs) = *(int*)(&inode->subdirs) + 1;
-    
-    // Set new dir's properties
-    inode_name_set(newdir_inode, dirname);
-    *(int*)(&newdir_inode->is_dir) = 1;
-    inode_data_set(fs, newdir_inode, "", 0); 
+    inode_journal(fs, inode);
+    inode->subdirs = inode->subdirs + 1;
+    inode_dirty(fs, inode);
+
+    return newdir_inode;
+}
+
+// Removes the given child's entry from the given parent dir, then releases
+// the child's inode (once no longer open). Returns 1 on success, else 0.
+// Note: The caller drops any cached path to the child, as it may be reused.
+// Assumes: ns_lock is held exclusively.
+static int child_unlink(FSHandle *fs, Inode *parent, Inode *child) {
+    if (child == parent || 
+        !dir_entry_remove(fs, parent, inode_name(fs, child)))
+        return 0; // Fail (not the parent's child)
+
+    if (child->is_dir) {
+        inode_journal(fs, parent);
+        parent->subdirs = parent->subdirs - 1;
+        inode_dirty(fs, parent);
+    }
+
+    inode_unlinked(fs, child);
+    return 1; // Success
+}
+
+// Removes the file or directory denoted by the given path from the file 
+// system. Returns 1 on success, else 0.
+static int child_remove(FSHandle *fs, const char *path) {
+    Inode *parent;
+    Inode *child;
+
+    // Split the given path into seperate path and filename elements
+    char *par_path, *name, *start;
+
+    if (!(start = str_path_split(path, &par_path, &name)))
+        return 0;
+
+    // Get the parent and child inode's
+    parent = resolve_path(fs, par_path);
+    child = resolve_path(fs, path);
+    free(start);
+
+    if (!parent || !child || !child_unlink(fs, parent, child))
+        return 0; // Fail (bad path)
+
+    // The inode may be reused, so its path must no longer resolve to it
+    dcache_drop(path);
+    return 1; // Success
+}
 
-    return newdir_inode;
+// Returns 1 if inode is the given dir or lies in the dir's subtree, else 0.
+// Walks up from inode to the root. O(depth).
+static int dir_contains(FSHandle *fs, Inode *dir, Inode *inode) {
+    while (inode != dir) {
+        if (!inode->is_dir || !inode_num(fs, inode))
+            return 0;                   // At a file, or the root
+        inode = inode_get(fs, dir_parent(fs, inode));
+    }
+    return 1;
 }
 
-// Removes the directory denoted by the given inode from the file system.
-// Returns 1 on success, else 0.
-static int child_remove(FSHandle *fs, const char *path) {
-    Inode *parent;
-    Inode *child;
+// Moves the given child of from_parent to to_parent, naming it to_name, by
+// relinking directory entries only. The child's data is left in place. If
+// target (to_parent's child named to_name) is given, its slot is pointed at
+// the child with a single store, then the target is released.
+// Returns: 1 on success, else 0 (to_parent's table or the name heap could not
+// grow).
+// Assumes: ns_lock is held exclusively, and the move is valid (the child is
+// not an ancestor of to_parent, and target is a file or an empty dir).
+static int child_move(FSHandle *fs, Inode *from_parent, Inode *child, 
+                      Inode *to_parent, char *to_name, Inode *target) {
+    // Grow the dest table first, as growing moves its slots
+    if (!target && !dir_entry_reserve(fs, to_parent))
+        return 0;
 
-    // Split the given path into seperate path and filename elements
-    char *par_path, *start, *token, *next;
-
-    start = next = strdup(path);        // Duplicate path so we can manipulate
-    next++;                             // Skip initial seperator
-    par_path = malloc(1);               // Init abs path str
-    *par_path = '\0';
-
-    while ((token = strsep(&next, FS_PATH_SEP))) {
-        if (next) {
-            par_path = realloc(par_path, str_len(par_path) + str_len(token) + 1);
-            strcat(par_path, FS_PATH_SEP);
-            strcat(par_path, token);
+    // Find both slots before renaming the child, as lookups compare names
+    DirEntry *old = dir_entry_find(fs, from_parent, inode_name(fs, child));
+    DirEntry *slot = target ? dir_entry_find(fs, to_parent, to_name) : NULL;
+    uint32_t ino = inode_num(fs, child);
+
+    if (!inode_name_set(fs, child, to_name))
+        return 0;
+
+    // Link the child under its new name, then unlink the old name
+    if (slot) {
+        fs_journal(fs, slot, ST_SZ_DIRENTRY);
+        slot->inode = ino;                      // Hash is to_name's already
+        fs_dirty(fs, slot, ST_SZ_DIRENTRY);
+        inode_lasttimes_set(fs, to_parent, 1);
+    } else {
+        dir_entry_place(fs, to_parent, str_hash(to_name), ino);
+        inode_lasttimes_set(fs, to_parent, 1);
+    }
+    dir_entry_drop(fs, from_parent, old);
+
+    if (child->is_dir)
+        dir_parent_set(fs, child, inode_num(fs, to_parent));
+
+    // Update the parents' subdir counts
+    if (child->is_dir || (target && target->is_dir)) {
+        inode_journal(fs, from_parent);
+        inode_journal(fs, to_parent);
+        if (child->is_dir) {
+            from_parent->subdirs = from_parent->subdirs - 1;
+            to_parent->subdirs = to_parent->subdirs + 1;
         }
+        if (target && target->is_dir)
+            to_parent->subdirs = to_parent->subdirs - 1;
+        inode_dirty(fs, from_parent);
+        inode_dirty(fs, to_parent);
     }
 
-    if (*par_path == '\0')
-        strcat(par_path, FS_PATH_SEP);  // Path is root
+    // Release the replaced target, once no longer open
+    if (target)
+        inode_unlinked(fs, target);
 
-    // Get the parent and child inode's
-    parent = resolve_path(fs, par_path);
-    child = resolve_path(fs, path);
+    return 1;
+}
 
-    // If valid parent/child...
-    if (parent && child) {
-        // Denote child's offset, in str form
-        size_t dir_offset = offset_from_ptr(fs, child);
-        char offset_str[digits_count(dir_offset) + 1];      
-        snprintf(offset_str, sizeof(offset_str), "%lu", dir_offset);
-
-        // Remove child's lookup line (ex: "filename:offset\n")
-        char *dir_name = strdup(child->name);
-        size_t data_sz = 0;
-        data_sz = str_len(dir_name) + str_len(offset_str) + 2; // +2 for : & nl
-        char *rmline = malloc(data_sz);
-
-        strcpy(rmline, dir_name);
-        strcat(rmline, FS_DIRDATA_SEP);
-        strcat(rmline, offset_str);
-        strcat(rmline, FS_DIRDATA_END);
-
-        // Get existing parent lookup table
-        char* par_data = malloc(*(int*)(&parent->file_size_b));
-        size_t par_data_sz = inode_data_get(fs, parent, par_data);
-
-        // Denote the start/end of the child's lookup line
-        size_t line_sz = str_len(rmline);
-        char *line_start = strstr(par_data, rmline);
-        char *offsetend_ptr = line_start + line_sz;
-
-        // Build new parent data without the child's lookup line
-        char *new_data = malloc(par_data_sz - line_sz);
-        size_t sz1 =  line_start - par_data;
-        size_t sz2 = par_data_sz - sz1 - line_sz;
-        memcpy(new_data, par_data, sz1);
-        memcpy(new_data + sz1, offsetend_ptr, sz2);
-        
-        // Update the parent to reflect removal of child
-        inode_data_set(fs, parent, new_data, sz1 + sz2);
-        if (child->is_dir)
-            *(int*)(&parent->subdirs) = *(int*)(&parent->subdirs) - 1;
-
-        // Format/release the child's inode
-        inode_data_remove(fs, child, 0); 
-        *(int*)(&child->is_dir) = 0;
-        *(int*)(&child->subdirs) = 0;
-
-        free(par_path);
-        free(start);
-        free(rmline);
-        free(dir_name);
-    
-        return 1; // Success
+// Renames from_child of from_parent to to_name under to_parent, replacing
+// to_child (to_parent's child of that name, if any), as rename does. If 
+// into_self, to_parent lies in from_child's subtree.
+// Returns: 0 on success, else an errno.
+// Note: The caller drops any cached paths the rename made stale.
+// Assumes: ns_lock is held exclusively.
+static int child_rename(FSHandle *fs, Inode *from_parent, Inode *from_child,
+                        Inode *to_parent, char *to_name, Inode *to_child, 
+                        int into_self) {
+    // Ensure the move is valid
+    if (!from_parent || !from_child || !to_parent)
+        return ENOENT;
+    if (from_child == from_parent || !inode_isdir(to_parent))
+        return (from_child == from_parent) ? EBUSY : ENOTDIR;
+    if (!inode_name_isvalid(to_name))
+        return EINVAL;
+    if (from_child->is_dir && into_self)
+        return EINVAL;                          // Into its own subtree
+    if (to_child && from_child->is_dir && !to_child->is_dir)
+        return ENOTDIR;
+    if (to_child && !from_child->is_dir && to_child->is_dir)
+        return EISDIR;
+    if (to_child && to_child->is_dir && dir_head(fs, to_child))
+        return ENOTEMPTY;
+
+    // Relink the child (a no-op if both names are for the same inode)
+    if (to_child != from_child && 
+        !child_move(fs, from_parent, from_child, to_parent, to_name, to_child))
+        return ENOSPC;
 
-    } else return 0; // Fail (bad path)
+    return 0;
 }
 
 
@@ -785,13 +2889,11 @@ static int child_remove(FSHandle *fs, const char *path) {
 
 
 // Creates a new file in the fs having the given properties.
-// Note: path is parent dir path, fname is the file name. Ex: '/' and 'file1'.
+// Note: parent is the parent dir's inode, fname is the file name.
 // Returns: A ptr to the newly created file's I-node (or NULL on fail).
-static Inode *file_new(FSHandle *fs, char *path, char *fname, char *data,
+static Inode *file_new(FSHandle *fs, Inode *parent, char *fname, char *data,
                        size_t data_sz) {
-    Inode *parent = resolve_path(fs, path);
-
-    if (!parent) {
+    if (!parent || !inode_isdir(parent)) {
         // printf("ERROR: invalid path\n");
         return NULL;
     }
@@ -801,85 +2903,101 @@ static Inode *file_new(FSHandle *fs, char *path, char *fname, char *data,
         return NULL;
     }
 
-    Inode *inode = inode_nextfree(fs);
-    if (!inode) {
-        printf("ERROR: Failed getting free inode for new file %s\n", fname);
+    if (!inode_name_isvalid(fname)) {
+        printf("ERROR: Invalid file name\n");
         return NULL;
     }
 
-    MemHead *memblock = memblock_nextfree(fs);
-    if (!memblock) {
-        printf("ERROR: Failed getting free memblock for new file %s\n", fname);
+    Inode *inode = inode_alloc(fs);
+    if (!inode) {
+        printf("ERROR: Failed getting free inode for new file %s\n", fname);
         return NULL;
     }
 
-    if (!inode_name_set(inode, fname)) {
-        printf("ERROR: Invalid file name\n");
+    // Name the inode and give it its data
+    if (!inode_name_set(fs, inode, fname)) {
+        inode_free(fs, inode);
         return NULL;
     }
-    
-    // Associate first memblock with the inode (by it's offset)
-    size_t offset_firstblk = offset_from_ptr(fs, (void*)memblock);
-    inode->offset_firstblk = (size_t*)offset_firstblk;
     inode_data_set(fs, inode, data, data_sz);
     
-    // Get the new file's inode offset and convert to str
-    size_t offset = offset_from_ptr(fs, inode);
-    char offset_str[digits_count(offset) + 1];      
-    snprintf(offset_str, sizeof(offset_str), "%zu", offset);
-
-    // Build new file's lookup line: "filename:offset\n"
-    size_t fileline_sz = 0;
-    fileline_sz = str_len(fname) + str_len(offset_str) + 2; // +2 for : and \n
-
-    char *fileline_data = malloc(fileline_sz);
-    strcpy(fileline_data, fname);
-    strcat(fileline_data, FS_DIRDATA_SEP);
-    strcat(fileline_data, offset_str);
-    strcat(fileline_data, FS_DIRDATA_END);
-    
-    // Append the lookup line to the parent dir's existing lookup data
-    inode_data_append(fs, parent, fileline_data);
-    free(fileline_data);
+    // Add the new file to the parent dir's table
+    if (!dir_entry_add(fs, parent, inode)) {
+        inode_data_remove(fs, inode);
+        inode_free(fs, inode);
+        return NULL;
+    }
 
     return inode;
 }
 
 
 // Resolves the given file or directory path and returns its associated inode.
+// The lookup cache is tried first. On a miss, each path component is looked 
+// up in its parent's table, without allocating, and the result is cached.
 static Inode* resolve_path(FSHandle *fs, const char *path) {
-    Inode* root_dir = fs_rootnode_get(fs);
-
-    // If path is root
-    if (strcmp(path, root_dir->name) == 0)
-        return root_dir;
-
-    Inode* curr_dir = root_dir;
-    int curr_ind = 1;
-    int path_ind = 0;
-    int path_len = strlen(path);
-    char curr_path_part[path_len];
-    while (curr_ind < path_len) {
-        path_ind = 0;
-        while (1) {
-            curr_path_part[path_ind] = path[curr_ind];
-            curr_ind = curr_ind + 1;
-            path_ind = path_ind + 1;
-            if (path[curr_ind] == '/' || path[curr_ind] == '\0') {
-                curr_ind = curr_ind + 1;
-                break;
-            }
-        }
-        curr_path_part[path_ind] = '\0';
+    Inode* curr_dir = fs_rootnode_get(fs);
+    char curr_path_part[NAME_MAXLEN];
+    const char *part = path;
+    size_t part_len = 0;
+    size_t inodenum;
+
+    if (dcache_get(path, &inodenum))
+        return inode_get(fs, inodenum);
+
+    while (curr_dir && *part) {
+        // Skip seperators, then denote the next component
+        while (*part == *FS_PATH_SEP)
+            part++;
+        part_len = strcspn(part, FS_PATH_SEP);
+        if (!part_len)
+            break;                          // Trailing seperator(s)
+        if (part_len >= NAME_MAXLEN)
+            return NULL;                    // Name too long to exist
+
+        memcpy(curr_path_part, part, part_len);
+        curr_path_part[part_len] = '\0';
         curr_dir = dir_subitem_get(fs, curr_dir, curr_path_part);
+        part += part_len;
     }
 
-    if (curr_dir && strcmp(curr_dir->name, curr_path_part) != 0)
-        return NULL; // Path not found
-    
+    if (curr_dir)
+        dcache_put(path, inode_num(fs, curr_dir));
+
     return curr_dir;
 }
 
+// Fills stbuf with the attributes of the given inode (see 
+// __myfs_getattr_implem), its num being its st_ino.
+// Assumes: ns_lock is held.
+static void inode_stat(FSHandle *fs, Inode *inode, uid_t uid, gid_t gid,
+                       struct stat *stbuf) {
+    inode_lock(fs, inode, 0);
+
+    //Reset the memory of the results container
+    memset(stbuf, 0, sizeof(struct stat));
+
+    //Populate stdbuf with the atrributes of the inode
+    stbuf->st_ino = inode_num(fs, inode);
+    stbuf->st_uid = uid;
+    stbuf->st_gid = gid;
+    stbuf->st_atim = time_from_ns(__atomic_load_n(&inode->last_acc, 
+                                                  __ATOMIC_RELAXED));
+    stbuf->st_mtim = time_from_ns(inode->last_mod);
+    stbuf->st_blocks = inode_blocks_used(fs, inode) * (MEMBLOCK_SZ_B / 512);
+    
+    if (inode->is_dir) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = inode->subdirs + 2;  // "+ 2" for . and .. 
+    } else {
+        stbuf->st_mode = S_IFREG | 0755;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = inode->file_size_b;
+    } 
+
+    inode_unlock(fs, inode);
+}
+
 /* End File helpers ------------------------------------------------------- */
 /* Begin emulation functins ----------------------------------------------- */
 
@@ -901,6 +3019,7 @@ static Inode* resolve_path(FSHandle *fs, const char *path) {
             uid_t         Owners's user ID (from args)
             gid_t         Owner's group ID (from args)
             off_t         Real file size, in bytes (for files only)
+            blkcnt_t      Num 512B blocks in use (less than the size if sparse)
             st_atim       Last access time
             st_mtim       Last modified time
             mode_t        File type/mode as S_IFDIR | 0755 for directories,
@@ -916,26 +3035,44 @@ int __myfs_getattr_implem(void *fsptr, size_t fssize, int *errnoptr,
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
-    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
+    fs_lock_ns(0);
+    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
 
-    //Reset the memory of the results container
-    memset(stbuf, 0, sizeof(struct stat));
+    inode_stat(fs, inode, uid, gid, stbuf);
 
-    //Populate stdbuf with the atrributes of the inode
-    stbuf->st_uid = uid;
-    stbuf->st_gid = gid;
-    stbuf->st_atim = *(struct timespec*)(&inode->last_acc); 
-    stbuf->st_mtim = *(struct timespec*)(&inode->last_mod);    
-    
-    if (inode->is_dir) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = *(int*)(&inode->subdirs) + 2;  // "+ 2" for . and .. 
-    } else {
-        stbuf->st_mode = S_IFREG | 0755;
-        stbuf->st_nlink = 1;
-        stbuf->st_size = *(int*)(&inode->file_size_b);
-    } 
+    fs_unlock_ns();
+    return 0;  // Success  
+}
+
+/* -- __myfs_getattrfh_implem -- */
+/* Like __myfs_getattr_implem, for the inode the handle fh (see 
+   __myfs_openfh_implem and __myfs_lookup_implem) refers to, rather than
+   a path. st_ino is set to its inode num.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (EBADF).
+
+*/
+int __myfs_getattrfh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                            uid_t uid, gid_t gid, uint64_t fh,
+                            struct stat *stbuf) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *inode;       // Inode the handle refers to
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    fs_lock_ns(0);
+    if ((!(inode = inode_from_fh(fs, fh, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
 
+    inode_stat(fs, inode, uid, gid, stbuf);
+
+    fs_unlock_ns();
     return 0;  // Success  
 }
 
@@ -985,63 +3122,119 @@ int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
-    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
+    fs_lock_ns(0);
+    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
 
     // Ensure path denotes a dir
     if (!inode->is_dir) {
         *errnoptr = ENOTDIR;
+        fs_unlock_ns();
         return -1;
     }
 
-    // Get the directory's lookup table and add an extra end char to help parse
-    char *data = malloc(*(int*)(&inode->file_size_b) + 1);
-    size_t data_sz = inode_data_get(fs, inode, data);
-    memcpy(data + data_sz + 1, FS_DIRDATA_END, 1);
+    // Nothing to report for an empty dir (no table)
+    DirHead *head = dir_head(fs, inode);
+    if (!head || !head->num_entries) {
+        fs_unlock_ns();
+        return 0;
+    }
 
-    // Denote count and build content string from lookup table data
-    char *token, *name, *next;
+    // Allocate the names array, then a copy of each child's name
     size_t names_count = 0;
-    size_t names_len = 0;
-
-    char *names = malloc(0);
-    next = name = data;
-    while ((token = strsep(&next, FS_DIRDATA_END))) {
-        if (!next || *token <= 64 || !inode_name_charvalid(*token)) break;
-
-        name = token;                               // Extract file/dir name
-        name = strsep(&name, FS_DIRDATA_SEP);
-        int nlen = strlen(name) + 1;                // +1 for null term
-        names_len += nlen;            
-
-        // Append the file/dir name
-        names = realloc(names, names_len);  
-        memcpy(names + names_len - nlen, name, nlen - 1);
-        memset(names + names_len - 1, '\0', 1);
+    char **names = calloc(head->num_entries, sizeof(char*));
+
+    if (!names) {
+        *errnoptr = EINVAL;
+        fs_unlock_ns();
+        return -1;
+    }
+
+    for (size_t i = 0; i < head->num_slots; i++) {
+        DirEntry *entry = dir_slot(fs, inode, i);
+        if (entry->inode == DIRENT_FREE || entry->inode == DIRENT_TOMB)
+            continue;
+
+        if (!(names[names_count] = 
+              strdup(inode_name(fs, inode_get(fs, entry->inode))))) {
+            for (size_t j = 0; j < names_count; j++)
+                free(names[j]);
+            free(names);
+            *errnoptr = EINVAL;
+            fs_unlock_ns();
+            return -1;
+        }
         names_count++;
     }
 
-    // Copy the items into namesptr (should combine with above, otherwise O(n^2)
-    *namesptr = calloc(names_count, 1);
+    fs_unlock_ns();
+    *namesptr = names;
+    return names_count;
+}
+
+/* -- __myfs_readdirfh_implem -- */
+/* Lists the directory the handle fh refers to, without allocating: each
+   child is passed to fill(fillctx, name, stbuf, next), in table order, 
+   starting at position offset. stbuf holds the child's attributes (see
+   __myfs_getattrfh_implem), so that no getattr is needed per child, and
+   next is the position after it, to resume from in O(1). The name and 
+   stbuf are valid only during the call. The listing stops early if fill
+   returns non-zero. . and .. are not listed. If children are added or
+   removed between calls, the table may be resized, and a listing resumed
+   from a position may then repeat or skip children.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately: EBADF,
+   ENOTDIR, or EINVAL for a negative offset.
+
+*/
+int __myfs_readdirfh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                            uid_t uid, gid_t gid, uint64_t fh, off_t offset,
+                            int (*fill)(void *, const char *, 
+                                        const struct stat *, off_t),
+                            void *fillctx) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *inode;       // Inode the handle refers to
+    struct stat stbuf;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
 
-    if (!namesptr) {
-        *errnoptr = EFAULT;
+    fs_lock_ns(0);
+    if ((!(inode = inode_from_fh(fs, fh, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
     }
-    else {
-        char **curr = *namesptr;  // To keep namesptr static as we iterate
-        next = names;
-        for (int i = 0; i < names_count; i++)
-        {
-            int len = str_len(next);
-            *curr = realloc(*curr, len + 1);
-            strcpy(*curr, next);
-            next += len+1;
-            *curr++;
-        }
+    if (!inode->is_dir) {
+        *errnoptr = ENOTDIR;
+        fs_unlock_ns();
+        return -1;
     }
+
+    // Nothing to list for an empty dir (no table)
+    DirHead *head = dir_head(fs, inode);
     
-    free(data);
+    for (size_t i = offset; head && i < head->num_slots; i++) {
+        DirEntry *entry = dir_slot(fs, inode, i);
+        if (entry->inode == DIRENT_FREE || entry->inode == DIRENT_TOMB)
+            continue;
+
+        Inode *child = inode_get(fs, entry->inode);
+        inode_stat(fs, child, uid, gid, &stbuf);
+        if (fill(fillctx, inode_name(fs, child), &stbuf, i + 1))
+            break;
+    }
 
-    return names_count;
+    fs_unlock_ns();
+    return 0;
 }
 
 /* -- __myfs_mknod_implem -- */
@@ -1070,36 +3263,26 @@ int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
     // Ensure file does not already exist
+    fs_lock_ns(1);
     if (fs_pathresolve(fs, path, errnoptr)) {
         *errnoptr = EEXIST;
+        fs_unlock_ns();
         return -1;
     }
 
     // Split the given path into seperate path and filename elements
-    char *abspath, *fname, *start, *token, *next;
+    char *abspath, *fname, *start;
     
-    start = next = strdup(path);    // Duplicate path so we can manipulate it
-    next++;                         // Skip initial seperator
-    abspath = malloc(1);            // Init abs path array
-    *abspath = '\0';
-
-    while ((token = strsep(&next, FS_PATH_SEP)))
-        if (!next) {
-            fname = token;
-        } else {
-            abspath = realloc(abspath, str_len(abspath) + str_len(token) + 1);
-            strcat(abspath, FS_PATH_SEP);
-            strcat(abspath, token);
-        }
-
-    // If parent is root dir
-    if (*abspath == '\0')
-        strcat(abspath, FS_PATH_SEP);
+    if (!(start = str_path_split(path, &abspath, &fname))) {
+        *errnoptr = EINVAL;
+        fs_unlock_ns();
+        return -1;
+    }
 
     // Create the file and do cleanup
-    Inode *newfile = file_new(fs, abspath, fname, "", 0);
-    free(abspath);
+    Inode *newfile = file_new(fs, resolve_path(fs, abspath), fname, "", 0);
     free(start);
+    fs_unlock_ns();
 
     if (!newfile) {
         *errnoptr = EINVAL;
@@ -1108,6 +3291,54 @@ int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
     return 0;       // Success
 }
 
+/* -- __myfs_mknodat_implem -- */
+/* Like __myfs_mknod_implem, for the file named name in the directory the
+   handle parent refers to. On success, the new file's attributes are put
+   into stbuf (see __myfs_getattrfh_implem), and a handle to it is taken
+   (see __myfs_lookup_implem).
+
+   On failure, -1 is returned and *errnoptr is set appropriately: EBADF,
+   ENOTDIR, ENOENT if the directory was removed, EEXIST, EINVAL for an 
+   invalid name, ENOSPC or ENOMEM.
+
+*/
+int __myfs_mknodat_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid, uint64_t parent,
+                          const char *name, struct stat *stbuf) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *dir;         // Inode the parent handle refers to
+    Inode *newfile;
+    int err = 0;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    fs_lock_ns(1);
+    if (!(dir = inode_from_fh(fs, parent, errnoptr)))
+        err = *errnoptr;
+    else if (!dir->is_dir)
+        err = ENOTDIR;
+    else if (inode_isorphan(fs, dir))
+        err = ENOENT;       // Removed, yet still held
+    else if (dir_subitem_get(fs, dir, (char*)name))
+        err = EEXIST;
+    else if (!inode_name_isvalid((char*)name))
+        err = EINVAL;
+    else if (!(newfile = file_new(fs, dir, (char*)name, "", 0)))
+        err = ENOSPC;
+    else if (!inode_open(fs, newfile))
+        err = ENOMEM;
+    else
+        inode_stat(fs, newfile, uid, gid, stbuf);
+    fs_unlock_ns();
+
+    if (err) {
+        *errnoptr = err;
+        return -1;  // Fail
+    }
+    return 0;       // Success
+}
+
 /* -- __myfs_unlink_implem -- */
 /* Implements an emulation of the unlink system call for regular files
    on the filesystem of size fssize pointed to by fsptr.
@@ -1130,16 +3361,62 @@ int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr,
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
-    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
+    fs_lock_ns(1);
+    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
 
     if (inode->is_dir || !child_remove(fs, path)) {
         *errnoptr = EINVAL;
+        fs_unlock_ns();
         return -1;  // Fail
     }
 
+    fs_unlock_ns();
     return 0;  // Success
 }
 
+/* -- __myfs_unlinkat_implem -- */
+/* Like __myfs_unlink_implem, for the file named name in the directory the
+   handle parent refers to.
+
+   On failure, -1 is returned and *errnoptr is set appropriately: EBADF,
+   ENOTDIR, ENOENT or EISDIR.
+
+*/
+int __myfs_unlinkat_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           uint64_t parent, const char *name) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *dir;         // Inode the parent handle refers to
+    Inode *child;
+    int err = 0;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    fs_lock_ns(1);
+    if (!(dir = inode_from_fh(fs, parent, errnoptr)))
+        err = *errnoptr;
+    else if (!dir->is_dir)
+        err = ENOTDIR;
+    else if (!(child = dir_subitem_get(fs, dir, (char*)name)))
+        err = ENOENT;
+    else if (child->is_dir)
+        err = EISDIR;
+    else if (!child_unlink(fs, dir, child))
+        err = EINVAL;
+    else
+        dcache_flush();     // Its path is unknown, and the inode may be reused
+    fs_unlock_ns();
+
+    if (err) {
+        *errnoptr = err;
+        return -1;  // Fail
+    }
+    return 0;       // Success
+}
+
 /* -- __myfs_rmdir_implem -- */
 /* Implements an emulation of the rmdir system call on the filesystem 
    of size fssize pointed to by fsptr. 
@@ -1165,22 +3442,76 @@ int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
-    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
+    fs_lock_ns(1);
+    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
 
     // Ensure dir empty
-    if (inode->file_size_b)  {
+    if (!inode->is_dir) {
+        *errnoptr = ENOTDIR;
+        fs_unlock_ns();
+        return -1;  // Fail
+    }
+    if (!dir_isempty(fs, inode))  {
         *errnoptr = ENOTEMPTY;
+        fs_unlock_ns();
         return -1;  // Fail
     }
 
     if (!child_remove(fs, path)) {
         *errnoptr = EINVAL;
+        fs_unlock_ns();
         return -1;  // Fail
     }
 
+    fs_unlock_ns();
     return 0;  // Success
 }
 
+/* -- __myfs_rmdirat_implem -- */
+/* Like __myfs_rmdir_implem, for the directory named name in the directory
+   the handle parent refers to.
+
+   On failure, -1 is returned and *errnoptr is set appropriately: EBADF,
+   ENOTDIR, ENOENT or ENOTEMPTY.
+
+*/
+int __myfs_rmdirat_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uint64_t parent, const char *name) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *dir;         // Inode the parent handle refers to
+    Inode *child;
+    int err = 0;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    fs_lock_ns(1);
+    if (!(dir = inode_from_fh(fs, parent, errnoptr)))
+        err = *errnoptr;
+    else if (!dir->is_dir)
+        err = ENOTDIR;
+    else if (!(child = dir_subitem_get(fs, dir, (char*)name)))
+        err = ENOENT;
+    else if (!child->is_dir)
+        err = ENOTDIR;
+    else if (!dir_isempty(fs, child))
+        err = ENOTEMPTY;
+    else if (!child_unlink(fs, dir, child))
+        err = EINVAL;
+    else
+        dcache_flush();     // Its path is unknown, and the inode may be reused
+    fs_unlock_ns();
+
+    if (err) {
+        *errnoptr = err;
+        return -1;  // Fail
+    }
+    return 0;       // Success
+}
+
 /* -- __myfs_mkdir_implem -- */
 /* Implements an emulation of the mkdir system call on the filesystem 
    of size fssize pointed to by fsptr. 
@@ -1202,39 +3533,29 @@ int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1;
 
     // Ensure file does not already exist
+    fs_lock_ns(1);
     if (fs_pathresolve(fs, path, errnoptr)) {
         *errnoptr = EEXIST;
+        fs_unlock_ns();
         return -1;
     }
 
     // Seperate the dir name from the path
-    char *par_path, *name, *start, *token, *next;
+    char *par_path, *name, *start;
     
-    start = next = strdup(path);    // Duplicate path so we can manipulate it
-    next++;                         // Skip initial seperator
-    par_path = malloc(1);           // Parent path buffer
-    *par_path = '\0';
-
-    while ((token = strsep(&next, FS_PATH_SEP)))
-        if (!next) {
-            name = token;
-        } else {
-            par_path = realloc(par_path, str_len(par_path) + str_len(token) + 1);
-            strcat(par_path, FS_PATH_SEP);
-            strcat(par_path, token);
-        }
-
-    // If parent is root
-    if (*par_path == '\0')
-        strcat(par_path, FS_PATH_SEP);
+    if (!(start = str_path_split(path, &par_path, &name))) {
+        *errnoptr = EINVAL;
+        fs_unlock_ns();
+        return -1;
+    }
 
     // Create the new dir
     Inode *parent = fs_pathresolve(fs, par_path, errnoptr);
     Inode *newdir = dir_new(fs, parent, name);
     
     // Cleanup
-    free(par_path);
     free(start);
+    fs_unlock_ns();
 
     if (!newdir) {
         *errnoptr = EINVAL;
@@ -1244,6 +3565,54 @@ int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
     return 0;       // Success
 }
 
+/* -- __myfs_mkdirat_implem -- */
+/* Like __myfs_mkdir_implem, for the directory named name in the directory
+   the handle parent refers to. On success, the new directory's attributes
+   are put into stbuf (see __myfs_getattrfh_implem), and a handle to it is
+   taken (see __myfs_lookup_implem).
+
+   On failure, -1 is returned and *errnoptr is set appropriately: EBADF,
+   ENOTDIR, ENOENT if the directory was removed, EEXIST, EINVAL for an 
+   invalid name, ENOSPC or ENOMEM.
+
+*/
+int __myfs_mkdirat_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uid_t uid, gid_t gid, uint64_t parent,
+                          const char *name, struct stat *stbuf) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *dir;         // Inode the parent handle refers to
+    Inode *newdir;
+    int err = 0;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    fs_lock_ns(1);
+    if (!(dir = inode_from_fh(fs, parent, errnoptr)))
+        err = *errnoptr;
+    else if (!dir->is_dir)
+        err = ENOTDIR;
+    else if (inode_isorphan(fs, dir))
+        err = ENOENT;       // Removed, yet still held
+    else if (dir_subitem_get(fs, dir, (char*)name))
+        err = EEXIST;
+    else if (!inode_name_isvalid((char*)name))
+        err = EINVAL;
+    else if (!(newdir = dir_new(fs, dir, (char*)name)))
+        err = ENOSPC;
+    else if (!inode_open(fs, newdir))
+        err = ENOMEM;
+    else
+        inode_stat(fs, newdir, uid, gid, stbuf);
+    fs_unlock_ns();
+
+    if (err) {
+        *errnoptr = err;
+        return -1;  // Fail
+    }
+    return 0;       // Success
+}
+
 /* Implements an emulation of the rename system call on the filesystem 
    of size fssize pointed to by fsptr. 
 
@@ -1288,87 +3657,96 @@ int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
     // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
-    // Get the indexes of the file/dir seperators and path sizes
-    size_t from_len, to_len;
-    size_t from_idx = str_name_offset(from, &from_len);
-    size_t to_idx = str_name_offset(to, &to_len);
+    // Seperate the parent dir paths from the names
+    char *from_path, *from_name, *from_start;
+    char *to_path, *to_name, *to_start;
 
-    char *from_path = strndup(from, (from_idx > 1 ) ? from_idx-1 : from_idx);
-    char *from_name = strndup(from + from_idx, from_len - from_idx);
-    char *to_path = strndup(to, to_idx);
-    char *to_name = strndup(to + to_idx, to_len - to_idx);
+    if (!(from_start = str_path_split(from, &from_path, &from_name))) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    if (!(to_start = str_path_split(to, &to_path, &to_name))) {
+        free(from_start);
+        *errnoptr = EINVAL;
+        return -1;
+    }
     
+    fs_lock_ns(1);
     Inode *from_parent = fs_pathresolve(fs, from_path, errnoptr);
+    Inode *from_child = fs_pathresolve(fs, from, errnoptr);
     Inode *to_parent = fs_pathresolve(fs, to_path, errnoptr);
+    Inode *to_child = to_parent ? resolve_path(fs, to) : NULL;
+    size_t from_len = strlen(from);
+    int into_self = strncmp(to, from, from_len) == 0 && 
+                    to[from_len] == *FS_PATH_SEP;
+    int err = child_rename(fs, from_parent, from_child, to_parent, to_name,
+                           to_child, into_self);
+
+    if (!err && to_child != from_child) {
+        if (from_child->is_dir) {
+            dcache_flush();     // Paths under the moved dir are stale
+        } else {
+            dcache_drop(from);
+            dcache_drop(to);    // Its old inode may be reused
+        }
+    }
 
-    Inode *from_child = fs_pathresolve(fs, from, errnoptr);
-    Inode *to_child = fs_pathresolve(fs, to, errnoptr);
-    
-    free(from_name);
-    free(from_path);
+    fs_unlock_ns();
+    free(from_start);
+    free(to_start);
 
-    // Ensure all the boys are in the band
-    if (!from_parent || !from_child || !to_parent) {
-        *errnoptr = EINVAL;
-        free(to_name);
-        free(to_path);
+    if (err) {
+        *errnoptr = err;
         return -1;
     }
 
-    // Begin the move... (Note: This could be done more efficiently) 
-    char *data = malloc(*(int*)(&from_child->file_size_b));
-    size_t sz; 
-
-    // If renaming a directory, it must either not exist or be an empty dir
-    if(from_child->is_dir) {
-        // If destination doesn't exist, create it and move the data
-        if(!to_child) {
-            // printf("Moving !child\n");
-            Inode *dest = dir_new(fs, to_parent, to_name);  // Create dest
-            sz = inode_data_get(fs, from_child, data);      // Get dir's data
-            inode_data_set(fs, dest, data, sz);             // Copy to dest
-            child_remove(fs, from);                         // Remove old dir
-        } 
-        
-        // If dest does exist and is empty, simply overwrite the existing data
-        else if (to_child->is_dir && !to_child->file_size_b) {
-            // printf("moving: to empty existing dir\n");
-            sz = inode_data_get(fs, from_child, data);      // Get dir's data
-            inode_data_set(fs, to_child, data, sz);         // Overwrite dest
-            child_remove(fs, from);                         // Remove old dir
-        }
-        
-        // Else, error
-        else {
-            *errnoptr = EINVAL;
-            free(data);
-            free(to_name);
-            free(to_path);
-            return -1;
-        }
-    }
+    return 0;  // Success
+}
 
-    // Else, renaming a regular file
-    else {
-        // printf("\nmoving: file\n");
+/* -- __myfs_renameat_implem -- */
+/* Like __myfs_rename_implem, moving the item named from_name in the 
+   directory the handle from_parent refers to, to to_name in the directory
+   to_parent refers to. Handles to the moved item stay valid.
 
-        sz = inode_data_get(fs, from_child, data);          // Get file's data
-        
-        // If dest exists, overwrite it in an atomic way, else just create it
-        if(to_child)
-            inode_data_set(fs, to_child, data, sz);         // TODO: Atomic
-        else 
-            file_new(fs, to_path, to_name, data, sz);
-        child_remove(fs, from);                             // Remove old file
-    }
+   On failure, -1 is returned and *errnoptr is set appropriately (as for
+   __myfs_rename_implem, or EBADF).
 
-    // Cleanup
-    free(data);
-    free(to_name);
-    free(to_path);
+*/
+int __myfs_renameat_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           uint64_t from_parent, const char *from_name,
+                           uint64_t to_parent, const char *to_name) {
+    FSHandle *fs;           // Handle to the file system
+    Inode *from_dir, *to_dir, *from_child, *to_child;
+    int err;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
-    // printf("\nrename end\n");
+    fs_lock_ns(1);
+    if (!(from_dir = inode_from_fh(fs, from_parent, errnoptr)) ||
+        !(to_dir = inode_from_fh(fs, to_parent, errnoptr))) {
+        fs_unlock_ns();
+        return -1;
+    }
+    if (inode_isorphan(fs, to_dir)) {
+        *errnoptr = ENOENT;     // Removed, yet still held
+        fs_unlock_ns();
+        return -1;
+    }
 
+    from_child = dir_subitem_get(fs, from_dir, (char*)from_name);
+    to_child = dir_subitem_get(fs, to_dir, (char*)to_name);
+    err = child_rename(fs, from_dir, from_child, to_dir, (char*)to_name, 
+                       to_child, 
+                       from_child && dir_contains(fs, from_child, to_dir));
+    if (!err && to_child != from_child)
+        dcache_flush();     // Paths are unknown, so any may be stale
+    fs_unlock_ns();
+
+    if (err) {
+        *errnoptr = err;
+        return -1;
+    }
     return 0;  // Success
 }
 
@@ -1391,32 +3769,76 @@ int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
 int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
                            const char *path, off_t offset) {
     FSHandle *fs;       // Handle to the file system
-    Inode *inode;       // Inode for the given path
+    Inode *inode;       // Inode for the given path
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
+    fs_lock_ns(0);
+    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
+    if (inode->is_dir || offset < 0) {
+        *errnoptr = inode->is_dir ? EISDIR : EINVAL;
+        fs_unlock_ns();
+        return -1;
+    }
+    inode_lock(fs, inode, 1);
+
+    int success = 1;
+    if ((size_t)offset != inode->file_size_b)
+        success = inode_data_truncate(fs, inode, offset);
+
+    inode_unlock(fs, inode);
+    fs_unlock_ns();
+
+    if (!success) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
+    return 0;  // Success
+}
+
+/* -- __myfs_truncatefh_implem -- */
+/* Like __myfs_truncate_implem, for the file the handle fh refers to.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (as for
+   __myfs_truncate_implem, or EBADF).
+
+*/
+int __myfs_truncatefh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                             uint64_t fh, off_t offset) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *inode;       // Inode the handle refers to
 
     // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
-    // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
-    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
-
-    // Read file data
-    char* orig_data = malloc(*(int*)(&inode->file_size_b));
-    size_t data_size = inode_data_get(fs, inode, orig_data);
-
-    // If request makes file larger
-    if (offset > data_size) {
-        size_t diff = offset- data_size;
-        char *diff_arr = malloc(diff);
-        memset(diff_arr, 0, diff);
-        inode_data_append(fs, inode, diff_arr);  // Pad w/zeroes
-        free(diff_arr);
+    fs_lock_ns(0);
+    if ((!(inode = inode_from_fh(fs, fh, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
     }
-    // Else, if request makes file smaller
-    else if (offset < data_size) {
-        inode_data_set(fs, inode, orig_data, offset);
+    if (inode->is_dir || offset < 0) {
+        *errnoptr = inode->is_dir ? EISDIR : EINVAL;
+        fs_unlock_ns();
+        return -1;
     }
-    // Otherwise, file size and contents are unchanged
+    inode_lock(fs, inode, 1);
+
+    int success = 1;
+    if ((size_t)offset != inode->file_size_b)
+        success = inode_data_truncate(fs, inode, offset);
 
+    inode_unlock(fs, inode);
+    fs_unlock_ns();
+
+    if (!success) {
+        *errnoptr = ENOSPC;
+        return -1;
+    }
     return 0;  // Success
 }
 
@@ -1456,11 +3878,175 @@ int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr,
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
-    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
+    fs_lock_ns(0);
+    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
+
+    fs_unlock_ns();
+    return 0; // Success
+}
+
+/* -- __myfs_openfh_implem -- */
+/* Like __myfs_open_implem, but also returns a handle to the opened file 
+   in *fhptr, for use by __myfs_readfh_implem and __myfs_writefh_implem 
+   until released by __myfs_release_implem. Reads and writes through the 
+   handle skip the path lookup. The handle stays valid if the file is 
+   renamed, and if it is unlinked, the file keeps its data until released.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (as for
+   __myfs_open_implem, or ENOMEM).
+
+*/
+int __myfs_openfh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         const char *path, uint64_t *fhptr) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *inode;       // Inode for the given path
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
+    fs_lock_ns(0);
+    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
+
+    if (!inode_open(fs, inode)) {
+        *errnoptr = ENOMEM;
+        fs_unlock_ns();
+        return -1;
+    }
+    *fhptr = inode_num(fs, inode);
+
+    fs_unlock_ns();
+    return 0; // Success
+}
+
+/* -- __myfs_hold_implem -- */
+/* Takes another handle to the inode the handle fh refers to, to be
+   released separately. 
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately: EBADF, or
+   ENOMEM.
+
+*/
+int __myfs_hold_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       uint64_t fh) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *inode;       // Inode the handle refers to
+    int res = 0;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    fs_lock_ns(0);
+    if ((!(inode = inode_from_fh(fs, fh, errnoptr)))) {
+        res = -1;
+    } else if (!inode_open(fs, inode)) {
+        *errnoptr = ENOMEM;
+        res = -1;
+    }
+    fs_unlock_ns();
+    return res;
+}
+
+/* -- __myfs_lookup_implem -- */
+/* Looks up the item named name in the directory the handle parent refers
+   to, taking a handle to it. Its attributes are put into stbuf (see 
+   __myfs_getattrfh_implem), st_ino being the handle. Like those from 
+   __myfs_openfh_implem, handles taken by lookups keep an unlinked item 
+   until released, n at a time by __myfs_forget_implem.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately: EBADF,
+   ENOTDIR, ENOENT or ENOMEM.
+
+*/
+int __myfs_lookup_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         uid_t uid, gid_t gid, uint64_t parent, 
+                         const char *name, struct stat *stbuf) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *dir;         // Inode the parent handle refers to
+    Inode *child;
+    int err = 0;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    fs_lock_ns(0);
+    if (!(dir = inode_from_fh(fs, parent, errnoptr)))
+        err = *errnoptr;
+    else if (!dir->is_dir)
+        err = ENOTDIR;
+    else if (!(child = dir_subitem_get(fs, dir, (char*)name)))
+        err = ENOENT;
+    else if (!inode_open(fs, child))
+        err = ENOMEM;
+    else
+        inode_stat(fs, child, uid, gid, stbuf);
+    fs_unlock_ns();
+
+    if (err) {
+        *errnoptr = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* -- __myfs_forget_implem -- */
+/* Releases n handles to the inode the handle fh refers to. If it was 
+   unlinked and these were its last handles, its inode and data are freed.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately: EBADF if
+   fh is not a handle to an inode in use.
 
+*/
+int __myfs_forget_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         uint64_t fh, uint64_t n) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *inode;       // Inode the handle refers to
+    int last;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    fs_lock_ns(0);
+    if ((!(inode = inode_from_fh(fs, fh, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
+    last = inode_release(fh, n);
+    fs_unlock_ns();
+
+    // No path leads to an orphan, so no one else can reopen or reclaim it
+    if (last) {
+        fs_lock_ns(1);
+        inode_orphan_reclaim(fs, inode_get(fs, fh));
+        fs_unlock_ns();
+    }
     return 0; // Success
 }
 
+/* -- __myfs_release_implem -- */
+/* Releases the handle fh returned by __myfs_openfh_implem (or 
+   __myfs_hold_implem). Same as __myfs_forget_implem with n = 1.
+
+*/
+int __myfs_release_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uint64_t fh) {
+    return __myfs_forget_implem(fsptr, fssize, errnoptr, fh, 1);
+}
+
 /* -- __myfs_read_implem -- */
 /* Implements an emulation of the read system call on the filesystem 
    of size fssize pointed to by fsptr.
@@ -1487,28 +4073,124 @@ int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
     // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
-    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
-    
-    // Read file data
-    char* full_buf = malloc(*(int*)(&inode->file_size_b));
-    char *cpy_buf = full_buf;
-    int cpy_size = 0;
-    size_t data_size = inode_data_get(fs, inode, full_buf);
+    fs_lock_ns(0);
+    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
+    inode_lock(fs, inode, 0);
+
+    // Copy only the requested range, straight into the caller's buffer
+    size_t got = inode_data_read(fs, inode, buf, size, offset);
+
+    inode_unlock(fs, inode);
+    fs_unlock_ns();
+    return got;  // Bytes read
+}
+
+/* -- __myfs_readfh_implem -- */
+/* Like __myfs_read_implem, for the file the open handle fh (see
+   __myfs_openfh_implem) refers to, rather than a path.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (as for
+   __myfs_read_implem, or EBADF).
+
+*/
+int __myfs_readfh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                         uint64_t fh, char *buf, size_t size, off_t offset) {
+    if (!size) return 0;    // If no bytes to read
+
+    FSHandle *fs;           // Handle to the file system
+    Inode *inode;           // Inode the handle refers to
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    fs_lock_ns(0);
+    if ((!(inode = inode_from_fh(fs, fh, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
+    inode_lock(fs, inode, 0);
+
+    size_t got = inode_data_read(fs, inode, buf, size, offset);
+
+    inode_unlock(fs, inode);
+    fs_unlock_ns();
+    return got;  // Bytes read
+}
+
+/* -- __myfs_readbuf_implem -- */
+/* Like __myfs_readfh_implem, but instead of copying them into a buffer, 
+   describes the bytes read as ranges of the memory at fsptr, in order, 
+   and passes these to reply(replyctx, segs, nsegs). Holes are ranges of a
+   block of zeros outside fsptr. The ranges hold the file's bytes only 
+   during the call, which runs under the file's lock, so reply should copy
+   (or splice) them out, and not modify them.
+
+   On success, the number of bytes read is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (as for 
+   __myfs_readfh_implem, ENOMEM, or the non-zero value reply returned).
+
+*/
+int __myfs_readbuf_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uint64_t fh, size_t size, off_t offset,
+                          int (*reply)(void *, const struct iovec *, int),
+                          void *replyctx) {
+    FSHandle *fs;           // Handle to the file system
+    Inode *inode;           // Inode the handle refers to
+    struct iovec *segs;
+    size_t got = 0;
+    int err;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
 
-    // If offset not beyond end of data
-    if (offset <= data_size) {
-        cpy_buf += offset;              // data index
-        cpy_size = data_size - offset;  // bytes to read
-        memcpy(buf, cpy_buf, cpy_size); 
+    fs_lock_ns(0);
+    if ((!(inode = inode_from_fh(fs, fh, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
     }
-    else {
-            *errnoptr = EFBIG;          // Max offset exceeded
+    inode_lock(fs, inode, 0);
+
+    inode_lasttimes_set(fs, inode, 0);
+    if ((size_t)offset < inode->file_size_b)
+        got = (size < inode->file_size_b - offset) 
+            ? size : inode->file_size_b - offset;
+
+    if ((segs = malloc(DATA_SEGS_MAX(got) * sizeof(struct iovec)))) {
+        size_t n = inode_data_segs(fs, inode, got, offset, segs);
+        err = reply(replyctx, segs, (int)n);
+        free(segs);
+    } else {
+        err = ENOMEM;
     }
 
-    free(full_buf);
+    inode_unlock(fs, inode);
+    fs_unlock_ns();
 
-    return cpy_size;  // Success
+    if (err) {
+        *errnoptr = err;
+        return -1;
+    }
+    return got;  // Bytes read
 }
 
 /* -- __myfs_write_implem -- */
@@ -1536,50 +4218,210 @@ int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
     // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
-    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
+    fs_lock_ns(0);
+    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
+    inode_lock(fs, inode, 1);
 
-    // If offset is 0, we replace all existing data with the given data
-    if (!offset) {
-        char *dup = strndup(buf, size);
-        inode_data_set(fs, inode, dup, size);
-        free(dup);
+    // Update only the affected memblocks, zero-filling past the end if needed
+    size_t written = inode_data_write(fs, inode, buf, size, offset);
+
+    inode_unlock(fs, inode);
+    fs_unlock_ns();
+
+    if (!written) {
+        *errnoptr = ENOSPC;     // No room for even a single byte
+        return -1;
+    }
+
+    return written;  // num bytes written
+}
+
+/* -- __myfs_writefh_implem -- */
+/* Like __myfs_write_implem, for the file the open handle fh (see
+   __myfs_openfh_implem) refers to, rather than a path.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (as for
+   __myfs_write_implem, or EBADF).
+
+*/
+int __myfs_writefh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                          uint64_t fh, const char *buf, size_t size, 
+                          off_t offset) {
+    if (!size) return 0;  // If no bytes to write
+
+    FSHandle *fs;       // Handle to the file system
+    Inode *inode;       // Inode the handle refers to
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
     }
-    
 
-    // Else, append to existing file data, starting at offset
-    else {   
-        // Read file's existing data
-        int new_data_sz;
-        char *new_data;
-        char *orig_data = malloc(*(int*)(&inode->file_size_b));
-        size_t orig_sz = inode_data_get(fs, inode, orig_data);
-
-        // If offset is not beyond end of data
-        if (offset <= orig_sz) { 
-            // Build 1st half of new_data from existing file data, starting at offset
-            new_data = strndup(orig_data, offset);
-
-            // Set 2nd half of new_data: size bytes from the buf param
-            new_data_sz = offset + size;
-            new_data = realloc(new_data, new_data_sz);
-            memcpy(new_data + offset, buf, size);
-
-            // Replace the file's data with the new data
-            inode_data_set(fs, inode, new_data, new_data_sz);
-            free(new_data);
-        } 
-
-        // Else, max offset exceeded
-        else {
-            *errnoptr = EFBIG;
-            size = 0; // Set return value
+    fs_lock_ns(0);
+    if ((!(inode = inode_from_fh(fs, fh, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
+    inode_lock(fs, inode, 1);
+
+    size_t written = inode_data_write(fs, inode, buf, size, offset);
+
+    inode_unlock(fs, inode);
+    fs_unlock_ns();
+
+    if (!written) {
+        *errnoptr = ENOSPC;     // No room for even a single byte
+        return -1;
+    }
+
+    return written;  // num bytes written
+}
+
+/* -- __myfs_writebuf_implem -- */
+/* Like __myfs_writefh_implem, but instead of copying the bytes from a 
+   buffer, readies the range to write, then passes it as ranges of the
+   memory at fsptr, in order, to fill(fillctx, segs, nsegs), which copies
+   (or splices) the bytes into them and returns how many it did. The call
+   runs under the file's lock. If fill copies fewer bytes, only these are
+   written: the rest of the range keeps its bytes, or reads as zeros if it
+   was a hole or past the end. As the data is only seen once it is in 
+   place, the holes in the range are mapped first, and those of their 
+   blocks that then hold only zeros are unmapped again, so that they stay
+   holes, as with __myfs_writefh_implem.
+
+   On success, the number of bytes written is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (as for
+   __myfs_writefh_implem, EISDIR, ENOMEM, or EIO if fill copied no bytes).
+
+*/
+int __myfs_writebuf_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           uint64_t fh, size_t size, off_t offset,
+                           size_t (*fill)(void *, const struct iovec *, int),
+                           void *fillctx) {
+    if (!size) return 0;  // If no bytes to write
+
+    FSHandle *fs;       // Handle to the file system
+    Inode *inode;       // Inode the handle refers to
+    struct iovec *segs;
+    BlockRun *holes;    // Runs of the range unmapped before the write
+    size_t end, old_sz, num_holes = 0, written = 0;
+    int was_inline, err = 0;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    if (offset < 0) {
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    if (!(segs = malloc(DATA_SEGS_MAX(size) * 
+                        (sizeof(struct iovec) + sizeof(BlockRun))))) {
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    holes = (BlockRun*)(segs + DATA_SEGS_MAX(size));
+
+    fs_lock_ns(0);
+    if ((!(inode = inode_from_fh(fs, fh, errnoptr))) || inode->is_dir) {
+        if (inode)
+            *errnoptr = EISDIR;     // Dir tables only change journaled
+        fs_unlock_ns();
+        free(segs);
+        return -1;
+    }
+    inode_lock(fs, inode, 1);
+
+    old_sz = inode->file_size_b;
+    was_inline = inode->is_inline;
+    if (!was_inline)
+        num_holes = inode_holes_find(fs, inode, offset / MEMBLOCK_SZ_B,
+                                     bytes_to_blocks(offset + size), holes);
+    end = inode_data_prepare(fs, inode, NULL, size, offset);
+    if (end > (size_t)offset) {
+        size_t n = inode_data_segs(fs, inode, end - offset, offset, segs);
+
+        if (inode->is_inline)
+            inode_inline_journal(fs, inode);
+        written = fill(fillctx, segs, (int)n);
+        if (written > end - offset)
+            written = end - offset;
+        for (size_t i = 0, left = written; i < n && left; i++) {
+            size_t len = (segs[i].iov_len < left) ? segs[i].iov_len : left;
+            fs_dirty(fs, segs[i].iov_base, len);
+            left -= len;
+        }
+
+        // Bytes readied but not filled must read as zeros where they were
+        // holes, or past the old end, as they may hold stale data
+        size_t from = offset + written;
+        for (size_t i = 0; i < num_holes; i++) {
+            size_t lo = holes[i].blk * MEMBLOCK_SZ_B;
+            size_t hi = (holes[i].blk + holes[i].len) * MEMBLOCK_SZ_B;
+            if (lo < from)
+                lo = from;
+            if (hi > end)
+                hi = end;
+            if (hi > old_sz)
+                hi = old_sz;        // Past it, zeroed below
+            if (lo < hi)
+                inode_data_xfer(fs, inode, NULL, hi - lo, lo, 0);
+        }
+        if (from < old_sz)
+            from = old_sz;
+        if (from < end)
+            inode_data_xfer(fs, inode, NULL, end - from, from, 0);
+
+        // Blocks of the holes that now hold only zeros are holes again, as
+        // __myfs_writefh_implem leaves them. If inline data moved out to
+        // blocks, all of the range's blocks are new, like holes.
+        if (was_inline) {
+            holes[0].blk = offset / MEMBLOCK_SZ_B;
+            holes[0].len = bytes_to_blocks(offset + size) - holes[0].blk;
+            num_holes = 1;
+        }
+        for (size_t i = 0; i < num_holes && !inode->is_inline; i++) {
+            size_t last = holes[i].blk + holes[i].len;
+            if (last > bytes_to_blocks(end))
+                last = bytes_to_blocks(end);
+            for (size_t lblk = holes[i].blk; lblk < last; lblk++) {
+                char *p = inode_data_ptr(fs, inode, lblk * MEMBLOCK_SZ_B);
+                if (p && block_iszero(p))
+                    inode_block_unmap(fs, inode, lblk);
+            }
         }
 
-        free(orig_data);
+        if (offset + written > inode->file_size_b) {
+            inode_journal(fs, inode);
+            inode->file_size_b = offset + written;
+        }
+        err = written ? 0 : EIO;
+    } else {
+        err = ENOSPC;           // No room for even a single byte
     }
+    inode_lasttimes_set(fs, inode, 1);
+
+    inode_unlock(fs, inode);
+    fs_unlock_ns();
+    free(segs);
 
-    return size;  // num bytes written
+    if (err) {
+        *errnoptr = err;
+        return -1;
+    }
+    return written;  // num bytes written
 }
 
 /* -- __myfs_utimens_implem -- */
@@ -1605,12 +4447,50 @@ int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
     // Get inode for the path (sets erronoptr = ENOENT and returns -1 on fail)
-    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) return -1;
+    fs_lock_ns(0);
+    if ((!(inode = fs_pathresolve(fs, path, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
+    inode_lock(fs, inode, 1);
 
     // Copy time structs to callers structs
-    memcpy(inode->last_acc, &ts[0], sizeof(struct timespec));
-    memcpy(inode->last_mod, &ts[1], sizeof(struct timespec));
-    
+    inode->last_acc = time_to_ns(&ts[0]);
+    inode->last_mod = time_to_ns(&ts[1]);
+    inode_dirty(fs, inode);
+
+    inode_unlock(fs, inode);
+    fs_unlock_ns();
+    return 0;
+}
+
+/* -- __myfs_utimensfh_implem -- */
+/* Like __myfs_utimens_implem, for the inode the handle fh refers to.
+
+   On failure, -1 is returned and *errnoptr is set appropriately (EBADF).
+
+*/
+int __myfs_utimensfh_implem(void *fsptr, size_t fssize, int *errnoptr,
+                            uint64_t fh, const struct timespec ts[2]) {
+    FSHandle *fs;       // Handle to the file system
+    Inode *inode;       // Inode the handle refers to
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    fs_lock_ns(0);
+    if ((!(inode = inode_from_fh(fs, fh, errnoptr)))) {
+        fs_unlock_ns();
+        return -1;
+    }
+    inode_lock(fs, inode, 1);
+
+    inode->last_acc = time_to_ns(&ts[0]);
+    inode->last_mod = time_to_ns(&ts[1]);
+    inode_dirty(fs, inode);
+
+    inode_unlock(fs, inode);
+    fs_unlock_ns();
     return 0;
 }
 
@@ -1645,16 +4525,135 @@ int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr,
     // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
     if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
 
-    size_t blocks_free = memblocks_numfree(fs);
-    stbuf->f_bsize = DATAFIELD_SZ_B;
-    stbuf->f_blocks = 0;
-    stbuf->f_bfree = blocks_free;
-    stbuf->f_bavail = blocks_free;
-    stbuf->f_namemax = NAME_MAXLEN;
+    // Report from the maintained counters, O(1)
+    pthread_mutex_lock(&alloc_lock);
+    stbuf->f_bsize = MEMBLOCK_SZ_B;
+    stbuf->f_frsize = MEMBLOCK_SZ_B;
+    stbuf->f_blocks = fs->num_memblocks - fs->first_datablk;
+    stbuf->f_bfree = fs->blocks_free;
+    stbuf->f_bavail = fs->blocks_free;
+    // Inodes are made on demand, so each free block could hold a group more
+    stbuf->f_files = fs->num_inodes + fs->blocks_free * INODES_PER_BLK;
+    stbuf->f_ffree = fs->inodes_free + fs->blocks_free * INODES_PER_BLK;
+    stbuf->f_favail = stbuf->f_ffree;
+    pthread_mutex_unlock(&alloc_lock);
+    stbuf->f_namemax = NAME_MAXLEN - 1;
+
+    return 0;
+}
+
+/* -- __myfs_grow_implem -- */
+/* Grows the filesystem pointed to by fsptr to fssize bytes, once the
+   memory at fsptr (and any backup-file behind it) was extended to that 
+   size by the caller. The new memory blocks join the free space, and the
+   journal moves to a larger run if one is due (making a checkpoint). Other
+   operations are held off while the filesystem grows, but may be passed
+   the size from before the grow.
+
+   Growing to a size not larger than the filesystem's is a no-op. Sizes 
+   past 64 GiB are capped.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately:
+   ENOMEM if there is no memory to track the new blocks, ENOSPC if the 
+   growth is too small to hold the larger free-space bitmap.
+
+*/
+int __myfs_grow_implem(void *fsptr, size_t fssize, int *errnoptr) {
+    FSHandle *fs;       // Handle to the file system
+    size_t n_blocks = fssize / MEMBLOCK_SZ_B;
+    int err = 0;
+
+    // Bind fs handle (sets erronoptr = EFAULT and returns -1 on fail)
+    if ((!(fs = fs_handle(fsptr, fssize, errnoptr)))) return -1; 
+
+    if (n_blocks > NAME_MAX_BLKS)
+        n_blocks = NAME_MAX_BLKS;
+
+    pthread_mutex_lock(&sync_lock);
+    fs_lock_ns(1);
+    if (n_blocks > fs->num_memblocks && !(err = fs_grow(fs, n_blocks)))
+        fs_journal_grow(fs);
+    fs_unlock_ns();
+    pthread_mutex_unlock(&sync_lock);
+
+    if (err) {
+        *errnoptr = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* -- __myfs_sync_implem -- */
+/* Writes back the parts of the filesystem of size fssize pointed to by
+   fsptr changed since the last sync, by calling flush(flushctx, offset,
+   len) for each run of changed bytes, offset being relative to fsptr.
+   Runs are whole memory blocks, so offset and len are multiples of the
+   block size. flush returns 0 on success, else -1.
+
+   Only changes made through this process are known. If there was no 
+   memory to track them, the whole filesystem is passed as a single run.
 
+   Once all changes are written back, the journal is emptied: the synced
+   state is the one a crash returns the metadata to.
+
+   On success, 0 is returned and *flushed is set to the num bytes passed
+   to flush.
+
+   On failure (flush failed for a run), -1 is returned and *errnoptr is 
+   set to EIO. Runs that failed are kept for the next sync.
+
+   Note: May run concurrently with any other operation. Syncs, and the
+   checkpoints other operations make when the journal fills, wait for one
+   another.
+
+*/
+int __myfs_sync_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       int (*flush)(void *, size_t, size_t), void *flushctx,
+                       size_t *flushed) {
+    FSHandle *fs = (FSHandle*)fsptr;
+    int failed = 0;
+
+    (void)fssize;       // The image's size is in its handle
+    *flushed = 0;
+
+    // If this process never mounted the image, it changed nothing
+    if (__atomic_load_n(&fs_mounted, __ATOMIC_ACQUIRE) != fsptr)
+        return 0;
+
+    // Write back most changes while other ops proceed, then the rest at a
+    // checkpoint, with other ops held off so it is a consistent state. No
+    // other checkpoint may empty the journal in between, as blocks taken
+    // from the dirty map are not yet written back.
+    pthread_mutex_lock(&sync_lock);
+    if (!fs_dirty_flushall(fs, flush, flushctx, flushed))
+        failed = 1;
+
+    fs_lock_ns(1);
+    if (!fs_checkpoint(fs, flush, flushctx, flushed))
+        failed = 1;
+    fs_unlock_ns();
+    pthread_mutex_unlock(&sync_lock);
+
+    if (failed) {
+        *errnoptr = EIO;
+        return -1;
+    }
     return 0;
 }
 
+/* -- __myfs_lookupstats_implem -- */
+/* Reports the number of path lookups served by the in-memory lookup cache
+   (hits) and the number that walked the path from the root (misses), since
+   the process started. The cache is process-local, so no fs is needed.
+
+*/
+void __myfs_lookupstats_implem(size_t *hits, size_t *misses) {
+    *hits = __atomic_load_n(&dcache_hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&dcache_misses, __ATOMIC_RELAXED);
+}
+
 /* End emulation functions  ----------------------------------------------- */
 /* Begin DEBUG  ----------------------------------------------------------- */
 